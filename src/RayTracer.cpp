@@ -1,28 +1,42 @@
 // The main ray tracer.
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <deque>
-
-#include <Fl/fl_ask.H>
+#include <limits>
+#include <utility>
 
 #include "RayTracer.h"
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/stats.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
-#include "ui/TraceUI.h"
-#include "global.h"
+#include "sampler.h"
 #include "vecCone.h"
 
 using namespace std;
 
+namespace
+{
+
+	// The branches below a hit, for deriving the keys of the rays spawned
+	// there and of the shadow rays.  Glossy reflection sample i is branch
+	// kReflected + i.
+	const SampleRng::Key kRefracted = 0;
+	const SampleRng::Key kShaded = 1;
+	const SampleRng::Key kReflected = 2;
+
+}
+
 // Trace a top-level ray through normalized window coordinates (x,y)
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
-vec3f RayTracer::trace(Scene *scene, double x, double y)
+vec3f RayTracer::trace(Scene *scene, double x, double y, SampleRng::Key seed)
 {
 	ray r(vec3f(0, 0, 0), vec3f(0, 0, 0));
 	scene->getCamera()->rayThrough(x, y, r);
@@ -33,65 +47,81 @@ vec3f RayTracer::trace(Scene *scene, double x, double y)
 	rayset.thresh = vec3f(1.0, 1.0, 1.0);
 	rayset.depth = 0;
 	Material air;
-	rayset.material_stack.push_front(&air);
+	const MaterialStack outermost = { &air, NULL };
+	rayset.materials = &outermost;
+	rayset.seed = seed;
 
-	return traceRay(rayset).clamp();
+	return (this->*rayKernel)(rayset).clamp();
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
+//
+// Features is the render's RenderSettings::features(), so the switches
+// are constants here and whatever is off compiles away.
+template <unsigned Features>
 vec3f RayTracer::traceRay(const TraceSet& rayset)
 {
-	if (rayset.thresh[0] <= traceUI->GetIntensityThreshold()
-		&& rayset.thresh[1] <= traceUI->GetIntensityThreshold()
-		&& rayset.thresh[2] <= traceUI->GetIntensityThreshold())
+	if (rayset.thresh[0] <= settings.intensityThreshold
+		&& rayset.thresh[1] <= settings.intensityThreshold
+		&& rayset.thresh[2] <= settings.intensityThreshold)
 	{
 		return vec3f();
 	}
 
+	++renderCounters.rays;
+
 	isect i;
 	if (rayset.scene->intersect(*rayset.r, i))
-	{
-		if (IsLeavingObject(rayset, i)) i.N = -i.N;
-		const Material &m = i.getMaterial();
-		const vec3f &shade = m.shade(rayset.scene, *rayset.r, i);
-		const vec3f intensity = prod(shade, rayset.thresh);
+		return shadeHit<Features>(rayset, i);
+	else
+		return vec3f(0.0, 0.0, 0.0);
+}
 
-		ReflectionSet reflect_rayset;
-		reflect_rayset.i = &i;
-		vec3f reflection = traceUI->IsEnableReflection()
-			? traceReflection(rayset, reflect_rayset) : vec3f();
+template <unsigned Features>
+vec3f RayTracer::shadeHit(const TraceSet& rayset, isect& i)
+{
+	const bool shadows = (Features & RenderSettings::kShadows) != 0;
+	const bool soft_shadows = shadows && (Features & RenderSettings::kSoftShadows) != 0;
+	const bool reflection = (Features & RenderSettings::kReflection) != 0;
+	const bool refraction = (Features & RenderSettings::kRefraction) != 0;
+	const bool fresnel = (Features & RenderSettings::kFresnel) != 0;
 
-		RefractionParam refract_param;
-		refract_param.i = &i;
-		vec3f refraction = traceUI->IsEnableRefraction()
-			? traceRefraction(rayset, refract_param) : vec3f();
+	// lives as long as i, as the refraction below may push it
+	Material hitMaterial;
+	i.resolveMaterial(hitMaterial);
 
-		if (traceUI->IsEnableFresnel()
-			&& (rayset.material_stack.front()->index != 1
-				|| i.getMaterial().index != 1))
-		{
-			const double fresnel_coeff = GetFresnelCoeff(rayset, i);
-			const double fresnel_ratio = traceUI->GetFresnelRatio();
+	if (IsLeavingObject(rayset, i)) i.N = -i.N;
+	const Material &m = i.getMaterial();
+	const vec3f &shade = m.shadeWith<shadows, soft_shadows>(rayset.scene,
+		*rayset.r, i, SampleRng::Derive(rayset.seed, kShaded), settings);
+	const vec3f intensity = prod(shade, rayset.thresh);
 
-			reflection = fresnel_ratio * fresnel_coeff * reflection
-				+ (1 - fresnel_ratio) * reflection;
-			refraction = fresnel_ratio * (1 - fresnel_coeff) * refraction
-				+ (1 - fresnel_ratio) * refraction;
-		}
-		return intensity + reflection + refraction;
-	}
-	else
+	auto trace = [this](const TraceSet& next) { return traceRay<Features>(next); };
+
+	ReflectionSet reflect_rayset;
+	reflect_rayset.i = &i;
+	vec3f reflected = reflection
+		? traceReflection(rayset, reflect_rayset, trace) : vec3f();
+
+	RefractionParam refract_param;
+	refract_param.i = &i;
+	vec3f refracted = refraction
+		? traceRefraction(rayset, refract_param, trace) : vec3f();
+
+	if (fresnel && HasFresnel(rayset, i))
 	{
-		return vec3f(0.0, 0.0, 0.0);
+		ApplyFresnel(GetFresnelCoeff(rayset, i), reflected, refracted);
 	}
+	return intensity + reflected + refracted;
 }
 
+template <class Trace>
 vec3f RayTracer::traceReflection(const TraceSet& rayset,
-	const ReflectionSet &reflect_rayset)
+	const ReflectionSet &reflect_rayset, Trace trace)
 {
 	const Material &m = reflect_rayset.i->getMaterial();
-	if (m.kr.iszero() || rayset.depth >= traceUI->getDepth())
+	if (m.kr.iszero() || rayset.depth >= settings.depth)
 	{
 		return vec3f();
 	}
@@ -100,7 +130,7 @@ vec3f RayTracer::traceReflection(const TraceSet& rayset,
 	const double dot_rn = reflect_rayset.i->N.dot(-rayset.r->getDirection());
 	const vec3f &center_dir = (2.0 * dot_rn * reflect_rayset.i->N-rayset.r->getDirection()).normalize();
 
-	const int sample = traceUI->GetGlossyReflectionSample();
+	const int sample = settings.glossySamples;
 	if (sample == 0)
 	{
 		ray reflection_r(out_point, center_dir);
@@ -110,16 +140,20 @@ vec3f RayTracer::traceReflection(const TraceSet& rayset,
 		next_rayset.r = &reflection_r;
 		next_rayset.thresh = prod(rayset.thresh, m.kr);
 		next_rayset.depth = rayset.depth + 1;
-		next_rayset.material_stack = rayset.material_stack;
-		return traceRay(next_rayset);
+		next_rayset.materials = rayset.materials;
+		next_rayset.seed = SampleRng::Derive(rayset.seed, kReflected);
+		return trace(next_rayset);
 	}
 	else
 	{
 		vec3f intensity;
 		VecCone vcg(center_dir, 0.1);
+		const Sampler &sampler = Sampler::Get(settings.sampler);
 		for (int i = 0; i < sample; ++i)
 		{
-			const vec3f &dir = vcg.Generate();
+			double u[2];
+			sampler.Generate(rayset.seed, i, 2, u);
+			const vec3f &dir = vcg.Generate(u[0], u[1]);
 			ray reflection_r(out_point, dir);
 
 			TraceSet next_rayset;
@@ -127,35 +161,40 @@ vec3f RayTracer::traceReflection(const TraceSet& rayset,
 			next_rayset.r = &reflection_r;
 			next_rayset.thresh = prod(rayset.thresh, m.kr);
 			next_rayset.depth = rayset.depth + 1;
-			next_rayset.material_stack = rayset.material_stack;
-			intensity += traceRay(next_rayset);
+			next_rayset.materials = rayset.materials;
+			next_rayset.seed = SampleRng::Derive(rayset.seed, kReflected + i);
+			intensity += trace(next_rayset);
 		}
 		return intensity / sample;
 	}
 }
 
+template <class Trace>
 vec3f RayTracer::traceRefraction(const TraceSet &rayset,
-	const RefractionParam &refelect_rayset)
+	const RefractionParam &refelect_rayset, Trace trace)
 {
 	const Material &m = refelect_rayset.i->getMaterial();
-	if (!m.kt.iszero() && rayset.depth < traceUI->getDepth())
+	if (!m.kt.iszero() && rayset.depth < settings.depth)
 	{
-		deque<const Material*> mat_stack = rayset.material_stack;
-		const Material *m2 = mat_stack.front();
+		const MaterialStack *mat_stack = rayset.materials;
+		MaterialStack entered;
+		const Material *m2 = mat_stack->material;
 		double ni, nt;
 		vec3f push_point;
 		if (IsLeavingObject(rayset, *refelect_rayset.i))
 		{
-			const Material *outside = mat_stack[1];
+			const Material *outside = mat_stack->outside->material;
 			ni = m.index;
 			nt = outside->index;
-			mat_stack.pop_front();
+			mat_stack = mat_stack->outside;
 		}
 		else
 		{
 			ni = m2->index;
 			nt = m.index;
-			mat_stack.push_front(&m);
+			entered.material = &m;
+			entered.outside = mat_stack;
+			mat_stack = &entered;
 		}
 		const double nr = ni / nt;
 		const double dot_rn = refelect_rayset.i->N.dot(-rayset.r->getDirection());
@@ -175,8 +214,9 @@ vec3f RayTracer::traceRefraction(const TraceSet &rayset,
 			next_rayset.r = &refraction_r;
 			next_rayset.thresh = prod(rayset.thresh, m.kt);
 			next_rayset.depth = rayset.depth + 1;
-			next_rayset.material_stack = mat_stack;
-			return traceRay(next_rayset);
+			next_rayset.materials = mat_stack;
+			next_rayset.seed = SampleRng::Derive(rayset.seed, kRefracted);
+			return trace(next_rayset);
 		}
 	}
 	else
@@ -187,7 +227,7 @@ vec3f RayTracer::traceRefraction(const TraceSet &rayset,
 
 bool RayTracer::IsLeavingObject(const TraceSet& rayset, const isect &i) const
 {
-	return (&i.getMaterial() == rayset.material_stack.front());
+	return (&i.getMaterial() == rayset.materials->material);
 }
 
 double RayTracer::GetFresnelCoeff(const TraceSet& rayset, const isect &i) const
@@ -197,11 +237,11 @@ double RayTracer::GetFresnelCoeff(const TraceSet& rayset, const isect &i) const
 	if (IsLeavingObject(rayset, i))
 	{
 		ni = i.getMaterial().index;
-		nt = rayset.material_stack.front()->index;
+		nt = rayset.materials->material->index;
 	}
 	else
 	{
-		ni = rayset.material_stack.front()->index;
+		ni = rayset.materials->material->index;
 		nt = i.getMaterial().index;
 	}
 	double r0 = (ni - nt) / (ni + nt);
@@ -225,11 +265,35 @@ double RayTracer::GetFresnelCoeff(const TraceSet& rayset, const isect &i) const
 	}
 }
 
+bool RayTracer::HasFresnel(const TraceSet& rayset, const isect &i) const
+{
+	return rayset.materials->material->index != 1
+		|| i.getMaterial().index != 1;
+}
+
+void RayTracer::ApplyFresnel(double fresnel_coeff, vec3f &reflected,
+	vec3f &refracted) const
+{
+	const double fresnel_ratio = settings.fresnelRatio;
+
+	reflected = fresnel_ratio * fresnel_coeff * reflected
+		+ (1 - fresnel_ratio) * reflected;
+	refracted = fresnel_ratio * (1 - fresnel_coeff) * refracted
+		+ (1 - fresnel_ratio) * refracted;
+}
+
 RayTracer::RayTracer()
 {
 	buffer = NULL;
 	buffer_width = buffer_height = 256;
 	scene = NULL;
+	nextPass = 0;
+	currentPass = 0;
+	m_workers = 1;
+	rayKernel = kernels(make_integer_sequence<unsigned,
+		RenderSettings::kNumFeatureSets>())[settings.features()];
+	hitKernel = hitKernels(make_integer_sequence<unsigned,
+		RenderSettings::kNumFeatureSets>())[settings.features()];
 
 	m_bSceneLoaded = false;
 }
@@ -237,6 +301,7 @@ RayTracer::RayTracer()
 
 RayTracer::~RayTracer()
 {
+	traceStop();
 	delete[] buffer;
 	delete scene;
 }
@@ -260,13 +325,16 @@ bool RayTracer::sceneLoaded()
 
 bool RayTracer::loadScene(const char* fn)
 {
+	// the workers must not be left with the old scene
+	traceStop();
+
 	try
 	{
 		scene = readScene(fn);
 	}
 	catch (const ParseError &pe)
 	{
-		fl_alert("ParseError: %s\n", pe.getMsg().c_str());
+		fprintf(stderr, "ParseError: %s\n", pe.getMsg().c_str());
 		return false;
 	}
 
@@ -278,6 +346,7 @@ bool RayTracer::loadScene(const char* fn)
 
 	bufferSize = buffer_width * buffer_height * 3;
 	buffer = new unsigned char[bufferSize];
+	sampleCounts.assign(buffer_width * buffer_height, 0);
 
 	scene->initScene();
 
@@ -286,8 +355,30 @@ bool RayTracer::loadScene(const char* fn)
 	return true;
 }
 
-void RayTracer::traceSetup(int w, int h)
+template <unsigned... Features>
+const RayTracer::RayKernel *RayTracer::kernels(integer_sequence<unsigned, Features...>)
 {
+	static const RayKernel table[] = { &RayTracer::traceRay<Features>... };
+	return table;
+}
+
+template <unsigned... Features>
+const RayTracer::HitKernel *RayTracer::hitKernels(integer_sequence<unsigned, Features...>)
+{
+	static const HitKernel table[] = { &RayTracer::shadeHit<Features>... };
+	return table;
+}
+
+void RayTracer::traceSetup(int w, int h, const RenderSettings &s)
+{
+	traceStop();
+
+	settings = s;
+	rayKernel = kernels(make_integer_sequence<unsigned,
+		RenderSettings::kNumFeatureSets>())[settings.features()];
+	hitKernel = hitKernels(make_integer_sequence<unsigned,
+		RenderSettings::kNumFeatureSets>())[settings.features()];
+
 	if (buffer_width != w || buffer_height != h)
 	{
 		buffer_width = w;
@@ -298,6 +389,7 @@ void RayTracer::traceSetup(int w, int h)
 		buffer = new unsigned char[bufferSize];
 	}
 	memset(buffer, 0, w*h * 3);
+	sampleCounts.assign(w * h, 0);
 }
 
 void RayTracer::traceLines(int start, int stop)
@@ -309,52 +401,872 @@ void RayTracer::traceLines(int start, int stop)
 	if (stop > buffer_height)
 		stop = buffer_height;
 
-	for (int j = start; j < stop; ++j)
-		for (int i = 0; i < buffer_width; ++i)
-			tracePixel(i, j);
+	renderCounters.discard();
+	for (int j = start; j < stop; j += kPacketSize)
+	{
+		const int j1 = min(j + kPacketSize, stop);
+		for (int i = 0; i < buffer_width; i += kPacketSize)
+			tracePixels(i, j, min(i + kPacketSize, buffer_width), j1);
+	}
+	renderCounters.flush();
+	Light::flushCacheStats();
 }
 
-void RayTracer::tracePixel(int i, int j)
+namespace
 {
-	vec3f col;
 
+	// Small enough that the pool has plenty of tiles to balance with,
+	// large enough that the rays of one tile share their cache lines.
+	// Tiles are traced in blocks of kPacketSize.
+	const int kTileSize = 16;
+
+	// Adaptive supersampling adds samples to a pixel this many at a time.
+	const int kAdaptiveBatch = 4;
+
+	// x and y with their bits interleaved
+	unsigned morton(unsigned x, unsigned y)
+	{
+		unsigned code = 0;
+		for (int bit = 0; bit < 16; ++bit)
+		{
+			code |= (x >> bit & 1u) << (2 * bit);
+			code |= (y >> bit & 1u) << (2 * bit + 1);
+		}
+		return code;
+	}
+
+	// The wavefront integrator bins a wave's rays by octant and by which of
+	// kBinCells^3 cells of the wave's extent they start in.
+	const int kBinCells = 4;
+	const int kBins = 8 * kBinCells * kBinCells * kBinCells;
+
+	// the same for x, y and z below kBinCells
+	unsigned morton(unsigned x, unsigned y, unsigned z)
+	{
+		unsigned code = 0;
+		for (int bit = 0; (1 << bit) < kBinCells; ++bit)
+		{
+			code |= (x >> bit & 1u) << (3 * bit);
+			code |= (y >> bit & 1u) << (3 * bit + 1);
+			code |= (z >> bit & 1u) << (3 * bit + 2);
+		}
+		return code;
+	}
+
+}
+
+void RayTracer::traceStart(int workers)
+{
+	traceStop();
 	if (!scene)
 		return;
 
-	double x = double(i) / double(buffer_width);
-	double y = double(j) / double(buffer_height);
+	// A progressive render takes a pass per sample, so that the whole
+	// image is there, if noisy, after the first.  Adaptive supersampling
+	// takes two: a few samples everywhere, then more where those disagree
+	// with each other or with the neighbouring pixels.  Otherwise every
+	// pixel is done in one.
+	passes.clear();
+	nextPass = 0;
+	const int max_samples = settings.superSampling * settings.superSampling;
+	if (settings.progressive)
+	{
+		accumulation.assign(buffer_width * buffer_height * 3, 0.0f);
+		passes.assign(max(1, max_samples), &RayTracer::accumulatePixels);
+	}
+	else if (settings.adaptiveThreshold > 0.0 && max_samples > kAdaptiveBatch)
+	{
+		estimates.assign(buffer_width * buffer_height, PixelEstimate());
+		passes.push_back(&RayTracer::estimatePixels);
+		passes.push_back(&RayTracer::refinePixels);
+	}
+	else
+	{
+		passes.push_back(&RayTracer::tracePixels);
+	}
+	m_workers = workers;
+
+	const unsigned columns = (buffer_width + kTileSize - 1) / kTileSize;
+	const unsigned rows = (buffer_height + kTileSize - 1) / kTileSize;
+	tiles.clear();
+	for (unsigned y = 0; y < rows; ++y)
+		for (unsigned x = 0; x < columns; ++x)
+			tiles.push_back(y << 16 | x);
+	sort(tiles.begin(), tiles.end(), [](unsigned a, unsigned b) {
+		return morton(a & 0xffff, a >> 16) < morton(b & 0xffff, b >> 16);
+	});
 
-	if (traceUI->GetSuperSampling() > 0)
+	startPass();
+}
+
+void RayTracer::startPass()
+{
+	currentPass = (int)nextPass;
+	const BlockPass pass = passes[nextPass++];
+	pool.start((int)tiles.size(), m_workers, [this, pass](int k) {
+		const int x0 = (tiles[k] & 0xffff) * kTileSize;
+		const int y0 = (tiles[k] >> 16) * kTileSize;
+		const int x1 = min(x0 + kTileSize, buffer_width);
+		const int y1 = min(y0 + kTileSize, buffer_height);
+		renderCounters.discard();
+		for (int y = y0; y < y1; y += kPacketSize)
+			for (int x = x0; x < x1; x += kPacketSize)
+				(this->*pass)(x, y, min(x + kPacketSize, x1), min(y + kPacketSize, y1));
+		renderCounters.flush();
+		Light::flushCacheStats();
+	});
+}
+
+bool RayTracer::traceWait(int milliseconds)
+{
+	if (!pool.wait(chrono::milliseconds(milliseconds)))
+		return false;
+	if (nextPass < passes.size())
 	{
-		const int sample = traceUI->GetSuperSampling();
-		const double pixel_w = 1.0 / buffer_width;
-		const double pixel_h = 1.0 / buffer_height;
-		const double sub_pixel_w = pixel_w / sample;
-		const double sub_pixel_h = pixel_h / sample;
-		for (int i = 0; i < sample; ++i)
+		startPass();
+		return false;
+	}
+	return true;
+}
+
+void RayTracer::traceProgress(int &pass, int &count) const
+{
+	pass = (int)nextPass;
+	count = (int)passes.size();
+}
+
+void RayTracer::traceStop()
+{
+	nextPass = passes.size();
+	pool.cancel();
+	pool.join();
+}
+
+void RayTracer::traceImage(int workers)
+{
+	traceStart(workers);
+	while (!traceWait(100))
+		;
+}
+
+void RayTracer::samplePosition(int i, int j, int s, double &x, double &y,
+	SampleRng::Key &seed) const
+{
+	x = double(i) / double(buffer_width);
+	y = double(j) / double(buffer_height);
+
+	// every sample's numbers depend on its pixel alone
+	const SampleRng::Key pixel_key = (SampleRng::Key)j * buffer_width + i;
+
+	if (settings.superSampling == 0)
+	{
+		seed = SampleRng::Derive(pixel_key, 0);
+		return;
+	}
+
+	const double pixel_w = 1.0 / buffer_width;
+	const double pixel_h = 1.0 / buffer_height;
+	double u[2];
+	Sampler::Get(settings.sampler).Generate(pixel_key, s, 2, u);
+	x += (u[0] - 0.5) * pixel_w;
+	y += (u[1] - 0.5) * pixel_h;
+	seed = SampleRng::Derive(pixel_key, s + 1);
+}
+
+void RayTracer::traceBlock(int x0, int y0, int x1, int y1, int s, vec3f *cols)
+{
+	double x[RayPacket::kMaxRays], y[RayPacket::kMaxRays];
+	SampleRng::Key seeds[RayPacket::kMaxRays];
+	int n = 0;
+	for (int j = y0; j < y1; ++j)
+		for (int i = x0; i < x1; ++i, ++n)
+			samplePosition(i, j, s, x[n], y[n], seeds[n]);
+	traceSamples(x, y, seeds, n, cols);
+}
+
+// What trace() does for each sample, but with the camera rays made and
+// intersected together.
+void RayTracer::traceSamples(const double *x, const double *y,
+	const SampleRng::Key *seeds, int n, vec3f *cols)
+{
+	// traceRay() traces nothing at all with the threshold this high
+	const vec3f thresh(1.0, 1.0, 1.0);
+	if (thresh[0] <= settings.intensityThreshold)
+	{
+		for (int k = 0; k < n; ++k)
+			cols[k] = vec3f();
+		return;
+	}
+
+	RayPacket packet;
+	scene->getCamera()->raysThrough(x, y, n, packet);
+	isect hits[RayPacket::kMaxRays];
+	const RayPacket::Mask found = scene->intersectPacket(packet, hits);
+	renderCounters.rays += n;
+
+	if (settings.wavefront)
+	{
+		traceWavefront(packet, hits, found, seeds, cols);
+		return;
+	}
+
+	Material air;
+	const MaterialStack outermost = { &air, NULL };
+	for (int k = 0; k < n; ++k)
+	{
+		if ((found >> k & 1) == 0)
 		{
-			const double base_y = y + ((double)i / sample - 0.5) * pixel_h;
-			for (int j = 0; j < sample; ++j)
-			{
-				const double base_x = x + ((double)j / sample - 0.5) * pixel_w;
+			cols[k] = vec3f();
+			continue;
+		}
+
+		TraceSet rayset;
+		rayset.scene = scene;
+		rayset.r = &packet.get(k);
+		rayset.thresh = thresh;
+		rayset.depth = 0;
+		rayset.materials = &outermost;
+		rayset.seed = seeds[k];
+		cols[k] = (this->*hitKernel)(rayset, hits[k]).clamp();
+	}
+}
+
+// The queues of the wavefront integrator.  They only grow, so once a
+// thread has traced a few batches it allocates nothing more.
+struct RayTracer::Wavefront
+{
+	// A ray waiting for its wave, with what traceRay() would be called
+	// with for it.
+	struct QueuedRay
+	{
+		ray r;
+		vec3f thresh;
+		int depth;
+		const MaterialStack *materials;
+		SampleRng::Key seed;
+	};
+
+	// A hit, with its own light and the rays it spawned, for summing up
+	// its colour once theirs are known.
+	struct Hit
+	{
+		int ray;				// the index of the ray that found it
+		isect i;
+		vec3f shade;
+		int reflected;			// the first of its reflection rays
+		int reflections;
+		int refracted;			// its refraction ray, or -1
+		bool hasFresnel;
+		double fresnel;			// GetFresnelCoeff(), if it has
+	};
+
+	// The shadow rays of one hit towards one light.
+	struct ShadowGroup
+	{
+		int hit;
+		const Light *light;
+		int first;				// into shadowRays
+		int count;
+	};
+
+	std::vector<QueuedRay> rays;
+	std::vector<vec3f> colors;		// of each ray, once summed up
+	// a wave's rays in the order they are traced, each with its bin
+	std::vector<std::pair<unsigned, int>> bins;
+	std::vector<std::pair<unsigned, int>> binned;
+	std::vector<const SceneObject*> struck;	// by each ray, or NULL
+	std::vector<Hit> hits;			// in wave order
+	std::vector<int> order;			// of a wave's hits, by material
+	std::vector<ShadowGroup> groups;
+	std::vector<Light::ShadowRay> shadowRays;
+	std::vector<vec3f> transmittance;
+
+	// Storage that hits and rays point to, so it may not move as it
+	// grows; the entries are reused from one batch to the next.
+	std::deque<Material> materials;
+	std::deque<MaterialStack> stacks;
+	size_t materialsUsed;
+	size_t stacksUsed;
+
+	void clear()
+	{
+		rays.clear();
+		colors.clear();
+		hits.clear();
+		materialsUsed = 0;
+		stacksUsed = 0;
+	}
+
+	Material &newMaterial()
+	{
+		if (materialsUsed == materials.size())
+			materials.emplace_back();
+		return materials[materialsUsed++];
+	}
+
+	const MaterialStack *keep(const MaterialStack &m)
+	{
+		if (stacksUsed == stacks.size())
+			stacks.emplace_back();
+		MaterialStack &copy = stacks[stacksUsed++];
+		copy = m;
+		return &copy;
+	}
+
+	void push(const ray &r, const vec3f &thresh, int depth,
+		const MaterialStack *materials, SampleRng::Key seed)
+	{
+		const QueuedRay q = { r, thresh, depth, materials, seed };
+		rays.push_back(q);
+		colors.push_back(vec3f());
+	}
+
+	void addHit(int ray, const isect &i)
+	{
+		Hit h;
+		h.ray = ray;
+		h.i = i;
+		h.reflected = 0;
+		h.reflections = 0;
+		h.refracted = -1;
+		h.hasFresnel = false;
+		h.fresnel = 0.0;
+		hits.push_back(h);
+	}
+};
+
+void RayTracer::traceWavefront(const RayPacket& packet, const isect *hits,
+	RayPacket::Mask found, const SampleRng::Key *seeds, vec3f *cols)
+{
+	static thread_local Wavefront w;
+	w.clear();
+
+	Material air;
+	const MaterialStack outermost = { &air, NULL };
+	const int n = packet.size();
+	for (int k = 0; k < n; ++k)
+	{
+		w.push(packet.get(k), vec3f(1.0, 1.0, 1.0), 0, &outermost, seeds[k]);
+		if (found >> k & 1)
+			w.addHit(k, hits[k]);
+	}
+
+	// Each wave's hits spawn the rays of the next, which traceRay() would
+	// trace one at a time: those below the threshold are dropped, and
+	// the rest looked for in the scene.
+	int first = 0;
+	while (first < (int)w.hits.size())
+	{
+		const int last = (int)w.hits.size();
+		const int spawned = (int)w.rays.size();
+		shadeWave(w, first, last);
+		traceWave(w, spawned);
+		first = last;
+	}
+
+	// Sum up the tree as shadeHit() does.  A hit's rays come after it, so
+	// from the last hit back every colour is known before it is needed.
+	for (int h = (int)w.hits.size() - 1; h >= 0; --h)
+	{
+		const Wavefront::Hit &hit = w.hits[h];
+
+		vec3f reflected;
+		if (hit.reflections > 0 && settings.glossySamples == 0)
+		{
+			reflected = w.colors[hit.reflected];
+		}
+		else if (hit.reflections > 0)
+		{
+			for (int k = 0; k < hit.reflections; ++k)
+				reflected += w.colors[hit.reflected + k];
+			reflected = reflected / settings.glossySamples;
+		}
+		vec3f refracted = hit.refracted >= 0
+			? w.colors[hit.refracted] : vec3f();
+
+		if (hit.hasFresnel)
+		{
+			ApplyFresnel(hit.fresnel, reflected, refracted);
+		}
+		w.colors[hit.ray] = prod(hit.shade, w.rays[hit.ray].thresh)
+			+ reflected + refracted;
+	}
+
+	for (int k = 0; k < n; ++k)
+		cols[k] = w.colors[k].clamp();
+}
+
+// Find the hits of rays [first, end) of w.  Unless RenderSettings::binRays
+// is off, they are traced sorted into bins, by the octant they head into
+// and then by where they start, along a Morton curve through the wave's
+// origins: rays traced one after another then take much the same path
+// through the hierarchy, and find its nodes and objects still in the
+// cache, where in the order spawned the next ray is as likely as not to
+// leave for another part of the scene.
+void RayTracer::traceWave(Wavefront &w, int first)
+{
+	const int end = (int)w.rays.size();
+	auto dropped = [&](const Wavefront::QueuedRay &q)
+	{
+		return q.thresh[0] <= settings.intensityThreshold
+			&& q.thresh[1] <= settings.intensityThreshold
+			&& q.thresh[2] <= settings.intensityThreshold;
+	};
+
+	w.bins.clear();
+	vec3f lo(HUGE_VAL, HUGE_VAL, HUGE_VAL);
+	vec3f hi(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+	for (int k = first; k < end; ++k)
+	{
+		const Wavefront::QueuedRay &q = w.rays[k];
+		if (dropped(q))
+			continue;
+		w.bins.push_back(make_pair(0u, k));
+		lo = minimum(lo, q.r.getPosition());
+		hi = maximum(hi, q.r.getPosition());
+	}
+
+	if (settings.binRays && w.bins.size() > 1)
+	{
+		// a counting sort, as the bins are few
+		unsigned counts[kBins + 1] = {};
+		vec3f scale;
+		for (int axis = 0; axis < 3; ++axis)
+			scale[axis] = hi[axis] > lo[axis]
+				? (kBinCells - 0.5) / (hi[axis] - lo[axis]) : 0.0;
+		for (auto &b : w.bins)
+		{
+			const ray &r = w.rays[b.second].r;
+			const vec3f cell = prod(r.getPosition() - lo, scale);
+			const unsigned octant = r.getSign(0) | r.getSign(1) << 1
+				| r.getSign(2) << 2;
+			b.first = octant * kBinCells * kBinCells * kBinCells
+				+ morton((unsigned)cell[0], (unsigned)cell[1], (unsigned)cell[2]);
+			++counts[b.first + 1];
+		}
+		for (int bin = 0; bin < kBins; ++bin)
+			counts[bin + 1] += counts[bin];
+		w.binned.resize(w.bins.size());
+		for (const auto &b : w.bins)
+			w.binned[counts[b.first]++] = b;
+		w.bins.swap(w.binned);
+	}
+
+	// How often a ray hits the same object as the one traced before it,
+	// in the order traced and in the order spawned.  It stands in for the
+	// cache locality the binning buys; nothing here counts cache misses.
+	w.struck.resize(end);
+	const SceneObject *previous = NULL;
+	long long repeats = 0;
+	for (size_t b = 0; b < w.bins.size(); ++b)
+	{
+		const int k = w.bins[b].second;
+		isect i;
+		const SceneObject *obj = NULL;
+		if (scene->intersect(w.rays[k].r, i))
+		{
+			w.addHit(k, i);
+			obj = i.obj;
+		}
+		w.struck[k] = obj;
+		if (b > 0 && obj == previous)
+			++repeats;
+		previous = obj;
+	}
+
+	long long repeats_spawned = 0;
+	bool any = false;
+	for (int k = first; k < end; ++k)
+	{
+		if (dropped(w.rays[k]))
+			continue;
+		if (any && w.struck[k] == previous)
+			++repeats_spawned;
+		previous = w.struck[k];
+		any = true;
+	}
+
+	const long long traced = (long long)w.bins.size();
+	renderCounters.rays += traced;
+	renderCounters.binned_rays += traced;
+	renderCounters.binned_repeats += repeats;
+	renderCounters.spawned_repeats += repeats_spawned;
+}
+
+// Shade hits [first, last) of w and queue the rays they spawn.
+void RayTracer::shadeWave(Wavefront &w, int first, int last)
+{
+	const unsigned features = settings.features();
+	const bool shadows = (features & RenderSettings::kShadows) != 0;
+	const bool soft_shadows = (features & RenderSettings::kSoftShadows) != 0;
+
+	auto traceSet = [&](const Wavefront::QueuedRay &q)
+	{
+		TraceSet rayset;
+		rayset.scene = scene;
+		rayset.r = &q.r;
+		rayset.thresh = q.thresh;
+		rayset.depth = q.depth;
+		rayset.materials = q.materials;
+		rayset.seed = q.seed;
+		return rayset;
+	};
+
+	// Hits on the same material are shaded one after another, so that its
+	// coefficients and its code stay at hand.
+	w.order.clear();
+	for (int h = first; h < last; ++h)
+	{
+		Wavefront::Hit &hit = w.hits[h];
+		hit.i.resolveMaterial(w.newMaterial());
+		w.order.push_back(h);
+	}
+	sort(w.order.begin(), w.order.end(), [&](int a, int b)
+	{
+		return &w.hits[a].i.obj->getMaterial() < &w.hits[b].i.obj->getMaterial();
+	});
+
+	// All but the lights, and the shadow rays to find how much of each
+	// light gets there.
+	w.groups.clear();
+	w.shadowRays.clear();
+	for (int h : w.order)
+	{
+		Wavefront::Hit &hit = w.hits[h];
+		const Wavefront::QueuedRay &q = w.rays[hit.ray];
+		if (IsLeavingObject(traceSet(q), hit.i)) hit.i.N = -hit.i.N;
+		const Material &m = hit.i.getMaterial();
+		hit.shade = m.shadeUnlit(scene, q.r, hit.i);
 
-				const double jitter_y = (rand() / (double)RAND_MAX - 0.5)
-					* sub_pixel_h + base_y;
-				const double jitter_x = (rand() / (double)RAND_MAX - 0.5)
-					* sub_pixel_w + base_x;
-				col += trace(scene, jitter_x, jitter_y);
+		const vec3f &point = q.r.at(hit.i.t);
+		const SampleRng::Key seed = SampleRng::Derive(q.seed, kShaded);
+		SampleRng::Key light_index = 0;
+		for (auto *l : scene->GetLights())
+		{
+			const SampleRng::Key light_seed = Material::lightSeed(seed, light_index++);
+			if (!Material::facesLight(q.r, hit.i, l))
+				continue;
+			if (!shadows)
+			{
+				hit.shade += m.shadeLight(q.r, hit.i, l, vec3f(1.0, 1.0, 1.0), settings);
+				continue;
 			}
+
+			Wavefront::ShadowGroup g;
+			g.hit = h;
+			g.light = l;
+			g.first = (int)w.shadowRays.size();
+			l->shadowRays(point, light_seed, soft_shadows, settings, w.shadowRays);
+			g.count = (int)w.shadowRays.size() - g.first;
+			w.groups.push_back(g);
 		}
-		col /= sample * sample;
 	}
-	else
+
+	// The shadow rays, a light at a time, so that each light's occluder
+	// cache sees all of its rays in a row.
+	w.transmittance.resize(w.shadowRays.size());
+	for (auto *l : scene->GetLights())
 	{
-		col = trace(scene, x, y);
+		for (const Wavefront::ShadowGroup &g : w.groups)
+		{
+			if (g.light != l)
+				continue;
+			for (int k = g.first; k < g.first + g.count; ++k)
+				w.transmittance[k] = l->transmittance(w.shadowRays[k], settings);
+		}
+	}
+
+	// The groups are in the order shadeWith() visits the lights, so each
+	// hit adds its lights up as it would.
+	for (const Wavefront::ShadowGroup &g : w.groups)
+	{
+		Wavefront::Hit &hit = w.hits[g.hit];
+		vec3f shadow_attenuation;
+		for (int k = g.first; k < g.first + g.count; ++k)
+			shadow_attenuation += w.transmittance[k];
+		shadow_attenuation = shadow_attenuation / g.count;
+		if (shadow_attenuation.iszero())
+			continue;
+		hit.shade += hit.i.getMaterial().shadeLight(w.rays[hit.ray].r, hit.i,
+			g.light, shadow_attenuation, settings);
+	}
+
+	// Queue the reflected and refracted rays.  The stack entry a refracted
+	// ray enters is copied to w, as traceRefraction() keeps it in its frame.
+	auto queue = [&](const TraceSet &next)
+	{
+		w.push(*next.r, next.thresh, next.depth, w.keep(*next.materials),
+			next.seed);
+		return vec3f();
+	};
+	for (int h : w.order)
+	{
+		Wavefront::Hit &hit = w.hits[h];
+		// a copy, as queueing may move the rays
+		const Wavefront::QueuedRay q = w.rays[hit.ray];
+		const TraceSet rayset = traceSet(q);
+
+		if (settings.reflection)
+		{
+			ReflectionSet reflect_rayset;
+			reflect_rayset.i = &hit.i;
+			hit.reflected = (int)w.rays.size();
+			traceReflection(rayset, reflect_rayset, queue);
+			hit.reflections = (int)w.rays.size() - hit.reflected;
+		}
+		if (settings.refraction)
+		{
+			RefractionParam refract_param;
+			refract_param.i = &hit.i;
+			const int before = (int)w.rays.size();
+			traceRefraction(rayset, refract_param, queue);
+			if ((int)w.rays.size() > before)
+				hit.refracted = before;
+		}
+		if (settings.fresnel && HasFresnel(rayset, hit.i))
+		{
+			hit.hasFresnel = true;
+			hit.fresnel = GetFresnelCoeff(rayset, hit.i);
+		}
 	}
+}
 
+void RayTracer::writePixel(int i, int j, const vec3f &col, int samples)
+{
 	unsigned char *pixel = buffer + (i + j * buffer_width) * 3;
 
 	pixel[0] = (int)(255.0 * col[0]);
 	pixel[1] = (int)(255.0 * col[1]);
 	pixel[2] = (int)(255.0 * col[2]);
+
+	sampleCounts[i + j * buffer_width] = (unsigned short)samples;
+}
+
+void RayTracer::tracePixel(int i, int j)
+{
+	renderCounters.discard();
+	tracePixels(i, j, i + 1, j + 1);
+	renderCounters.flush();
+	Light::flushCacheStats();
+}
+
+void RayTracer::tracePixels(int x0, int y0, int x1, int y1)
+{
+	vec3f cols[RayPacket::kMaxRays];
+	vec3f sums[RayPacket::kMaxRays];
+
+	if (!scene)
+		return;
+
+	const int n = (x1 - x0) * (y1 - y0);
+	const int sample = max(1, settings.superSampling * settings.superSampling);
+	for (int s = 0; s < sample; ++s)
+	{
+		traceBlock(x0, y0, x1, y1, s, cols);
+		for (int k = 0; k < n; ++k)
+			sums[k] += cols[k];
+	}
+
+	int k = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i, ++k)
+		{
+			sums[k] /= sample;
+			writePixel(i, j, sums[k], sample);
+		}
+	}
+	renderCounters.samples += sample * n;
+	renderCounters.pixels += n;
+}
+
+// One pass of a progressive render: the pass's sample of each pixel is
+// added to the sums, and the buffer shows their mean.
+void RayTracer::accumulatePixels(int x0, int y0, int x1, int y1)
+{
+	const int s = currentPass;
+	vec3f cols[RayPacket::kMaxRays];
+	traceBlock(x0, y0, x1, y1, s, cols);
+
+	int k = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i, ++k)
+		{
+			float *sum = &accumulation[(i + j * buffer_width) * 3];
+			for (int c = 0; c < 3; ++c)
+				sum[c] += (float)cols[k][c];
+			writePixel(i, j, vec3f(sum[0], sum[1], sum[2]) / (s + 1), s + 1);
+		}
+	}
+
+	const int n = (x1 - x0) * (y1 - y0);
+	renderCounters.samples += n;
+	if (s == 0)
+		renderCounters.pixels += n;
+}
+
+void RayTracer::PixelEstimate::add(const vec3f &col)
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		sum[c] += (float)col[c];
+		sum_sq[c] += (float)(col[c] * col[c]);
+	}
+	++count;
+}
+
+vec3f RayTracer::PixelEstimate::mean() const
+{
+	return vec3f(sum[0], sum[1], sum[2]) / count;
+}
+
+double RayTracer::PixelEstimate::standardError() const
+{
+	if (count < 2)
+		return numeric_limits<double>::infinity();
+
+	double error = 0.0;
+	for (int c = 0; c < 3; ++c)
+	{
+		const double mean = (double)sum[c] / count;
+		const double variance = max(0.0,
+			((double)sum_sq[c] - count * mean * mean) / (count - 1));
+		error = max(error, sqrt(variance / count));
+	}
+	return error;
+}
+
+// The first pass of adaptive supersampling: the first batch of samples,
+// kept for the second pass and shown in the meantime.
+void RayTracer::estimatePixels(int x0, int y0, int x1, int y1)
+{
+	vec3f cols[RayPacket::kMaxRays];
+	for (int s = 0; s < kAdaptiveBatch; ++s)
+	{
+		traceBlock(x0, y0, x1, y1, s, cols);
+		int k = 0;
+		for (int j = y0; j < y1; ++j)
+			for (int i = x0; i < x1; ++i, ++k)
+				estimates[i + j * buffer_width].add(cols[k]);
+	}
+
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i)
+		{
+			const PixelEstimate &e = estimates[i + j * buffer_width];
+			writePixel(i, j, e.mean(), e.count);
+		}
+	}
+}
+
+// Whether pixel (i, j) wants more than its first batch: it does if the
+// standard error of its colour is above the threshold.  A pixel whose
+// first batch all landed on one side of an edge agrees with itself, but
+// stands out from the pixel on the other side, so that wants more too.
+// The first-pass estimates are only read here, so that the neighbours see
+// the same thing however the tiles are scheduled.
+bool RayTracer::needsRefining(int i, int j) const
+{
+	const double threshold = settings.adaptiveThreshold;
+	const PixelEstimate &e = estimates[i + j * buffer_width];
+	if (e.standardError() > threshold)
+		return true;
+
+	const vec3f mean = e.mean();
+	const int neighbours[4][2] = { { i - 1, j }, { i + 1, j }, { i, j - 1 }, { i, j + 1 } };
+	for (const auto &n : neighbours)
+	{
+		if (n[0] < 0 || n[0] >= buffer_width || n[1] < 0 || n[1] >= buffer_height)
+			continue;
+		const vec3f difference = estimates[n[0] + n[1] * buffer_width].mean() - mean;
+		for (int c = 0; c < 3; ++c)
+			if (fabs(difference[c]) > threshold)
+				return true;
+	}
+	return false;
+}
+
+// The second pass: more samples, a batch at a time, until the standard
+// error of each pixel's colour is below the threshold.  The pixels still
+// refining have all taken the same number of samples, so each sample of
+// a batch is traced for all of them together, as in the first pass.
+void RayTracer::refinePixels(int x0, int y0, int x1, int y1)
+{
+	const int max_samples = settings.superSampling * settings.superSampling;
+	const double threshold = settings.adaptiveThreshold;
+	const int width = x1 - x0;
+
+	PixelEstimate e[RayPacket::kMaxRays];
+	int active[RayPacket::kMaxRays];
+	int n = 0;
+	int k = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i, ++k)
+		{
+			e[k] = estimates[i + j * buffer_width];
+			if (needsRefining(i, j))
+				active[n++] = k;
+		}
+	}
+
+	double x[RayPacket::kMaxRays], y[RayPacket::kMaxRays];
+	SampleRng::Key seeds[RayPacket::kMaxRays];
+	vec3f cols[RayPacket::kMaxRays];
+	while (n > 0 && e[active[0]].count < max_samples)
+	{
+		const int batch_start = e[active[0]].count;
+		const int batch_end = min(batch_start + kAdaptiveBatch, max_samples);
+		for (int s = batch_start; s < batch_end; ++s)
+		{
+			for (int a = 0; a < n; ++a)
+				samplePosition(x0 + active[a] % width, y0 + active[a] / width, s,
+					x[a], y[a], seeds[a]);
+			traceSamples(x, y, seeds, n, cols);
+			for (int a = 0; a < n; ++a)
+				e[active[a]].add(cols[a]);
+		}
+
+		int still = 0;
+		for (int a = 0; a < n; ++a)
+			if (e[active[a]].standardError() > threshold)
+				active[still++] = active[a];
+		n = still;
+	}
+
+	k = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i, ++k)
+		{
+			writePixel(i, j, e[k].mean(), e[k].count);
+			renderCounters.samples += e[k].count;
+		}
+	}
+	renderCounters.pixels += k;
+}
+
+void RayTracer::getSampleHeatmap(unsigned char *&buf, int &w, int &h)
+{
+	w = buffer_width;
+	h = buffer_height;
+	heatmap.assign(w * h * 3, 0);
+
+	int most = 1;
+	for (unsigned short n : sampleCounts)
+		most = max(most, (int)n);
+
+	// blue for the fewest samples, through magenta, to red for the most;
+	// black where nothing was traced
+	for (int k = 0; k < w * h; ++k)
+	{
+		if (sampleCounts[k] == 0)
+			continue;
+		const double t = (double)sampleCounts[k] / most;
+		heatmap[k * 3 + 0] = (unsigned char)(255.0 * t);
+		heatmap[k * 3 + 2] = (unsigned char)(255.0 * (1.0 - t));
+	}
+	buf = heatmap.data();
 }
\ No newline at end of file
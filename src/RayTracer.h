@@ -3,9 +3,14 @@
 
 // The main ray tracer.
 
-#include <deque>
+#include <utility>
+#include <vector>
+
 #include "scene/scene.h"
 #include "scene/ray.h"
+#include "scene/settings.h"
+#include "RenderPool.h"
+#include "sampleRng.h"
 
 class Material;
 
@@ -15,26 +20,65 @@ public:
 	RayTracer();
 	~RayTracer();
 
-	vec3f trace(Scene *scene, double x, double y);
+	vec3f trace(Scene *scene, double x, double y, SampleRng::Key seed = 0);
 
 	void getBuffer(unsigned char *&buf, int &w, int &h);
+
+	// The number of samples each pixel of the last render took, as an
+	// image: blue for the fewest, red for the most.
+	void getSampleHeatmap(unsigned char *&buf, int &w, int &h);
 	double aspectRatio();
-	void traceSetup(int w, int h);
+	// Size the buffer and take the settings for the renders to come.
+	void traceSetup(int w, int h, const RenderSettings &s);
 	void traceLines(int start = 0, int stop = 10000000);
 	void tracePixel(int i, int j);
 
+	// Every sample of every pixel in the block [x0, x1) x [y0, y1), which
+	// is at most kPacketSize square, with the camera rays in packets.
+	void tracePixels(int x0, int y0, int x1, int y1);
+
+	// Pixels are traced in blocks this wide and high, so that one packet
+	// takes a sample of each.
+	static const int kPacketSize = 8;
+
+	// Trace the whole image in small tiles on a pool of worker threads.
+	// traceStart() returns at once; traceWait() reports whether the image
+	// is done, waiting up to the given number of milliseconds for it and
+	// moving on to the next pass over the image if there is one, and
+	// traceStop() abandons the tiles not yet begun.  traceImage() does
+	// all of it and returns when the image is done.
+	void traceStart(int workers);
+	bool traceWait(int milliseconds);
+	void traceStop();
+	void traceImage(int workers);
+
+	// The pass under way, from 1, and how many the render takes.
+	void traceProgress(int &pass, int &count) const;
+
 	bool loadScene(const char* fn);
 
 	bool sceneLoaded();
 
 private:
+	// The materials a ray is inside, innermost first.  An entry lives in
+	// the frame of the traceRefraction() call that entered it and points
+	// to the one outside, so children share their parent's stack and
+	// entering or leaving never allocates.  The wavefront integrator,
+	// whose rays outlive that frame, keeps a copy in its queues.
+	struct MaterialStack
+	{
+		const Material *material;
+		const MaterialStack *outside;
+	};
+
 	struct TraceSet
 	{
 		Scene *scene;
 		const ray *r;
 		vec3f thresh;
 		int depth;
-		std::deque<const Material*> material_stack;
+		const MaterialStack *materials;
+		SampleRng::Key seed;	// names this ray's place in the ray tree
 	};
 
 	struct ReflectionSet
@@ -47,20 +91,129 @@ private:
 		const isect *i;
 	};
 
+	// The kernels, compiled for every RenderSettings::features() mask.
+	// shadeHit() is the part of traceRay() after the intersection, for
+	// rays whose hit was found in a packet.
+	template <unsigned Features>
 	vec3f traceRay(const TraceSet& param);
-	vec3f traceReflection(const TraceSet& param, const ReflectionSet &rparam);
-	vec3f traceRefraction(const TraceSet& param, const RefractionParam &rparam);
+	template <unsigned Features>
+	vec3f shadeHit(const TraceSet& param, isect& i);
+
+	// Spawn the rays reflected or refracted at a hit, handing each to
+	// trace(), which returns its colour: traceRay() for the kernels, a
+	// queue for the wavefront integrator.
+	template <class Trace>
+	vec3f traceReflection(const TraceSet& param, const ReflectionSet &rparam,
+		Trace trace);
+	template <class Trace>
+	vec3f traceRefraction(const TraceSet& param, const RefractionParam &rparam,
+		Trace trace);
+
+	// traceRay() for each mask, indexed by it
+	typedef vec3f (RayTracer::*RayKernel)(const TraceSet& param);
+	template <unsigned... Features>
+	static const RayKernel *kernels(std::integer_sequence<unsigned, Features...>);
+
+	// shadeHit() for each mask
+	typedef vec3f (RayTracer::*HitKernel)(const TraceSet& param, isect& i);
+	template <unsigned... Features>
+	static const HitKernel *hitKernels(std::integer_sequence<unsigned, Features...>);
 
 	bool IsLeavingObject(const TraceSet& param, const isect &i) const;
 
 	double GetFresnelCoeff(const TraceSet& param, const isect &i) const;
 
+	// Does Fresnel's law weigh the light leaving i?  Not between two
+	// materials of index 1.  ApplyFresnel() does, with GetFresnelCoeff().
+	bool HasFresnel(const TraceSet& param, const isect &i) const;
+	void ApplyFresnel(double fresnel_coeff, vec3f &reflected,
+		vec3f &refracted) const;
+
+	// The breadth-first integrator, for RenderSettings::wavefront: the
+	// rays of a packet, whose hits are found, are followed one bounce at
+	// a time as a batch.  Each wave's hits are sorted by material and
+	// shaded together, their shadow rays traced together light by light,
+	// and the rays they spawn queued for the next wave, which is binned
+	// by direction and origin before it is traced; then the colours
+	// are summed up the ray tree in the order traceRay() sums them, so
+	// the two give the same image.  The queues live in a Wavefront, one
+	// per render thread.
+	struct Wavefront;
+	void traceWavefront(const RayPacket& packet, const isect *hits,
+		RayPacket::Mask found, const SampleRng::Key *seeds, vec3f *cols);
+	void shadeWave(Wavefront &w, int first, int last);
+	void traceWave(Wavefront &w, int first);
+
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
 	int bufferSize;
 	Scene *scene;
 
 	bool m_bSceneLoaded;
+
+	// the settings of the render, fixed while it is under way, and the
+	// kernel they call for
+	RenderSettings settings;
+	RayKernel rayKernel;
+	HitKernel hitKernel;
+
+	// Where sample s of pixel (i, j) crosses the image, and the key of
+	// its ray; sample s is point s of the pixel's pattern, or without
+	// supersampling the pixel's centre.
+	void samplePosition(int i, int j, int s, double &x, double &y,
+		SampleRng::Key &seed) const;
+	// Sample s of every pixel of a block, row by row, into cols; the
+	// camera rays go through the scene as one packet.
+	void traceBlock(int x0, int y0, int x1, int y1, int s, vec3f *cols);
+	// The same for any n samples crossing the image at (x, y), with either
+	// integrator.
+	void traceSamples(const double *x, const double *y,
+		const SampleRng::Key *seeds, int n, vec3f *cols);
+	void writePixel(int i, int j, const vec3f &col, int samples);
+
+	// The colour of a pixel so far, and how sure it is, for adaptive
+	// supersampling.  Kept in floats, as there is one per pixel.
+	struct PixelEstimate
+	{
+		PixelEstimate() : sum(), sum_sq(), count(0) {}
+
+		void add(const vec3f &col);
+		vec3f mean() const;
+
+		// of the mean, in the worst channel
+		double standardError() const;
+
+		float sum[3];
+		float sum_sq[3];
+		int count;
+	};
+
+	void estimatePixels(int x0, int y0, int x1, int y1);
+	bool needsRefining(int i, int j) const;
+	void refinePixels(int x0, int y0, int x1, int y1);
+	void accumulatePixels(int x0, int y0, int x1, int y1);
+
+	// A render is one or more passes over every tile, each calling one of
+	// the block methods, tracePixels() or those above, on every block.
+	typedef void (RayTracer::*BlockPass)(int x0, int y0, int x1, int y1);
+	void startPass();
+
+	std::vector<BlockPass> passes;
+	size_t nextPass;
+	int currentPass;	// its index; written before the pass starts
+	int m_workers;
+
+	std::vector<PixelEstimate> estimates;
+	std::vector<float> accumulation;	// colour sums of a progressive render
+	std::vector<unsigned short> sampleCounts;
+	std::vector<unsigned char> heatmap;
+
+	// The tiles of the image in Morton order, each as its column in the
+	// low 16 bits and its row in the high ones.  Neighbouring indices are
+	// neighbouring tiles, so the pool's contiguous runs are compact
+	// patches of the image rather than strips.
+	std::vector<unsigned> tiles;
+	RenderPool pool;
 };
 
 #endif // __RAYTRACER_H__
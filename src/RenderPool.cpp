@@ -0,0 +1,150 @@
+#include "RenderPool.h"
+
+namespace
+{
+
+	unsigned long long pack(unsigned front, unsigned back)
+	{
+		return (unsigned long long)back << 32 | front;
+	}
+
+	unsigned frontOf(unsigned long long range) { return (unsigned)range; }
+	unsigned backOf(unsigned long long range) { return (unsigned)(range >> 32); }
+
+}
+
+RenderPool::RenderPool()
+	: capacity(0), cancelled(false), batch(0), active(0), busy(0), quit(false)
+{
+}
+
+RenderPool::~RenderPool()
+{
+	cancel();
+	join();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : threads)
+		t.join();
+}
+
+int RenderPool::defaultWorkers()
+{
+	const int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+void RenderPool::start(int count, int workers, const std::function<void(int)>& fn)
+{
+	cancel();
+	join();
+
+	if (workers < 1)
+		workers = 1;
+	if (workers > count)
+		workers = count > 0 ? count : 1;
+
+	// every worker is idle now, so the runs can be replaced under them
+	if (workers > capacity)
+	{
+		runs.reset(new Run[workers]);
+		capacity = workers;
+	}
+	while ((int)threads.size() < workers)
+		threads.push_back(std::thread(&RenderPool::work, this, (int)threads.size()));
+
+	// contiguous runs keep each worker on neighbouring tiles
+	for (int w = 0; w < workers; ++w)
+	{
+		const unsigned front = (unsigned)((long long)count * w / workers);
+		const unsigned back = (unsigned)((long long)count * (w + 1) / workers);
+		runs[w].range.store(pack(front, back));
+	}
+
+	task = fn;
+	cancelled = false;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		++batch;
+		active = workers;
+		busy = workers;
+	}
+	wake.notify_all();
+}
+
+bool RenderPool::wait(std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	return finished.wait_for(guard, timeout, [this] { return busy == 0; });
+}
+
+void RenderPool::join()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	finished.wait(guard, [this] { return busy == 0; });
+}
+
+void RenderPool::cancel()
+{
+	cancelled = true;
+}
+
+void RenderPool::work(int id)
+{
+	unsigned seen = 0;
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;)
+	{
+		wake.wait(guard, [&] { return quit || (batch != seen && id < active); });
+		if (quit)
+			return;
+		seen = batch;
+
+		guard.unlock();
+		int k;
+		while (take(id, k))
+			task(k);
+		guard.lock();
+
+		if (--busy == 0)
+			finished.notify_all();
+	}
+}
+
+// The next tile for worker id: the front of its own run, or failing that
+// the back of someone else's.
+bool RenderPool::take(int id, int& k)
+{
+	if (cancelled)
+		return false;
+
+	std::atomic<unsigned long long>& own = runs[id].range;
+	unsigned long long range = own.load();
+	while (frontOf(range) < backOf(range))
+	{
+		if (own.compare_exchange_weak(range, pack(frontOf(range) + 1, backOf(range))))
+		{
+			k = (int)frontOf(range);
+			return true;
+		}
+	}
+
+	for (int i = 1; i < active; ++i)
+	{
+		std::atomic<unsigned long long>& victim = runs[(id + i) % active].range;
+		range = victim.load();
+		while (frontOf(range) < backOf(range))
+		{
+			if (victim.compare_exchange_weak(range, pack(frontOf(range), backOf(range) - 1)))
+			{
+				k = (int)backOf(range) - 1;
+				return true;
+			}
+		}
+	}
+	return false;
+}
@@ -0,0 +1,80 @@
+//
+// RenderPool.h
+//
+// A set of worker threads kept for the life of the RayTracer, and the
+// scheduler that hands them the tiles of an image.  start() deals the tiles
+// out in contiguous runs, one run per worker, and returns at once.  A worker
+// takes tiles from the front of its own run; when that is empty it takes
+// them from the back of the others', so a worker that drew empty sky ends
+// up helping with the busy parts of the image instead of sitting idle.
+//
+// Each run is a pair of indices packed into one atomic word.  The owner
+// moves the front and thieves move the back, both by compare-and-swap, so
+// no tile is ever handed out twice and nothing is locked per tile.
+//
+
+#ifndef __RENDERPOOL_H__
+#define __RENDERPOOL_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class RenderPool
+{
+public:
+	RenderPool();
+	~RenderPool();
+
+	// Run task(k) for every k in [0, count) on the given number of
+	// workers, starting more threads if there are too few.  The call
+	// returns at once; use wait() to find out when the batch is done.
+	// A batch still running is cancelled first.
+	void start(int count, int workers, const std::function<void(int)>& task);
+
+	// Wait up to timeout for the batch.  True once it has finished, in
+	// which case every tile has been run or skipped by cancel().
+	bool wait(std::chrono::milliseconds timeout);
+
+	// Wait for the batch however long it takes.
+	void join();
+
+	// Tiles not yet begun are skipped; the ones in progress are finished.
+	void cancel();
+
+	// A sensible default: the number of hardware threads, or 1 if unknown.
+	static int defaultWorkers();
+
+private:
+	struct Run
+	{
+		std::atomic<unsigned long long> range;	// front in the low half, back in the high one
+	};
+
+	void work(int id);
+	bool take(int id, int& k);
+
+	std::vector<std::thread> threads;
+	std::unique_ptr<Run[]> runs;
+	int capacity;		// the number of entries in runs
+
+	std::function<void(int)> task;
+	std::atomic<bool> cancelled;
+
+	// The batch in progress, the number of workers taking part in it and
+	// how many of those are still at work.  Guarded by lock.
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	unsigned batch;
+	int active;
+	int busy;
+	bool quit;
+};
+
+#endif // __RENDERPOOL_H__
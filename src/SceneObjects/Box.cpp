@@ -7,27 +7,28 @@
 
 bool Box::intersectLocal(const ray& r, isect& i) const
 {
-	double tfar = std::numeric_limits<double>::max();
+	const vec3f& p = r.getPosition();
+	const vec3f& inv_d = r.getInverseDirection();
 	double tnear = -std::numeric_limits<double>::max();
+	double tfar = std::numeric_limits<double>::max();
 	int tnear_axis = 0;
+	int tfar_axis = 0;
 
 	for (int i = 0; i < 3; ++i)
 	{
 		if (r.getDirection()[i] == 0)
 		{
 			// parallel to plane
-			if (r.getPosition()[i] < -0.5 || r.getPosition()[i] > 0.5)
+			if (p[i] < -0.5 || p[i] > 0.5)
 			{
 				return false;
 			}
+			continue;
 		}
 
-		double t1 = (-0.5 - r.getPosition()[i]) / r.getDirection()[i];
-		double t2 = (0.5 - r.getPosition()[i]) / r.getDirection()[i];
-		if (t1 > t2)
-		{
-			std::swap(t1, t2);
-		}
+		// the sign bit picks the slab faces the ray enters and leaves by
+		double t1 = ((r.getSign(i) ? 0.5 : -0.5) - p[i]) * inv_d[i];
+		double t2 = ((r.getSign(i) ? -0.5 : 0.5) - p[i]) * inv_d[i];
 		if (t1 > tnear)
 		{
 			tnear = t1;
@@ -36,31 +37,33 @@ bool Box::intersectLocal(const ray& r, isect& i) const
 		if (t2 < tfar)
 		{
 			tfar = t2;
+			tfar_axis = i;
 		}
-		if (tnear > tfar || tfar < 0)
+		if (tnear > tfar || tfar <= r.getTMin() || tnear >= r.getTMax())
 		{
-			// missed || behind box
+			// missed || outside the ray's interval
 			return false;
 		}
 	}
 
 	i.obj = this;
-	i.t = tnear;
-	switch (tnear_axis)
+	if (tnear > r.getTMin())
 	{
-	default:
-		printf("Box::intersectLocal ???\n");
-	case 0:
-		i.N = vec3f((r.getDirection()[0] < 0.0) ? 1.0 : -1.0, 0.0, 0.0);
-		break;
-
-	case 1:
-		i.N = vec3f(0.0, (r.getDirection()[1] < 0.0) ? 1.0 : -1.0, 0.0);
-		break;
-
-	case 2:
-		i.N = vec3f(0.0, 0.0, (r.getDirection()[2] < 0.0) ? 1.0 : -1.0);
-		break;
+		// entering: the normal faces against the ray
+		i.t = tnear;
+		i.N = vec3f(0.0, 0.0, 0.0);
+		i.N[tnear_axis] = r.getSign(tnear_axis) ? 1.0 : -1.0;
+	}
+	else if (tfar < r.getTMax())
+	{
+		// starting inside the box: report where the ray leaves it
+		i.t = tfar;
+		i.N = vec3f(0.0, 0.0, 0.0);
+		i.N[tfar_axis] = r.getSign(tfar_axis) ? -1.0 : 1.0;
+	}
+	else
+	{
+		return false;
 	}
 	return true;
 }
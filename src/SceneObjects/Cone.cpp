@@ -42,11 +42,15 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 	double t1 = (-b - disc) / (2.0 * a);
 	double t2 = (-b + disc) / (2.0 * a);
 
-	if( t2 < RAY_EPSILON ) {
+	if( t2 < RAY_EPSILON || t2 <= r.getTMin() ) {
 		return false;
 	}
 
-	if( t1 > RAY_EPSILON ) {
+	if( t1 > RAY_EPSILON && t1 > r.getTMin() ) {
+		if( t1 >= r.getTMax() ) {
+			return false;
+		}
+
 		// Two intersections.
 		vec3f P = r.at( t1 );
 		double z = P[2];
@@ -61,6 +65,10 @@ bool Cone::intersectBody( const ray& r, isect& i ) const
 		}
 	}
 
+	if( t2 >= r.getTMax() ) {
+		return false;
+	}
+
 	vec3f P = r.at( t2 );
 	double z = P[2];
 	if( z >= 0.0 && z <= height ) {
@@ -110,11 +118,15 @@ bool Cone::intersectCaps( const ray& r, isect& i ) const
 		r2 = b_radius;
 	}
 
-	if( t2 < RAY_EPSILON ) {
+	if( t2 < RAY_EPSILON || t2 <= r.getTMin() ) {
 		return false;
 	}
 
-	if( t1 >= RAY_EPSILON ) {
+	if( t1 >= RAY_EPSILON && t1 > r.getTMin() ) {
+		if( t1 >= r.getTMax() ) {
+			return false;
+		}
+
 		vec3f p( r.at( t1 ) );
 		if( (p[0]*p[0] + p[1]*p[1]) <= r1 * r1 ) {
 			i.t = t1;
@@ -128,6 +140,10 @@ bool Cone::intersectCaps( const ray& r, isect& i ) const
 		}
 	}
 
+	if( t2 >= r.getTMax() ) {
+		return false;
+	}
+
 	vec3f p( r.at( t2 ) );
 	if( (p[0]*p[0] + p[1]*p[1]) <= r2 * r2 ) {
 		i.t = t2;
@@ -48,13 +48,17 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 
 	double t2 = (-b + discriminant) / (2.0 * a);
 
-	if( t2 <= RAY_EPSILON ) {
+	if( t2 <= RAY_EPSILON || t2 <= r.getTMin() ) {
 		return false;
 	}
 
 	double t1 = (-b - discriminant) / (2.0 * a);
 
-	if( t1 > RAY_EPSILON ) {
+	if( t1 > RAY_EPSILON && t1 > r.getTMin() ) {
+		if( t1 >= r.getTMax() ) {
+			return false;
+		}
+
 		// Two intersections.
 		vec3f P = r.at( t1 );
 		double z = P[2];
@@ -66,6 +70,10 @@ bool Cylinder::intersectBody( const ray& r, isect& i ) const
 		}
 	}
 
+	if( t2 >= r.getTMax() ) {
+		return false;
+	}
+
 	vec3f P = r.at( t2 );
 	double z = P[2];
 	if( z >= 0.0 && z <= 1.0 ) {
@@ -109,11 +117,15 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 		t2 = (-pz)/dz;
 	}
 
-	if( t2 < RAY_EPSILON ) {
+	if( t2 < RAY_EPSILON || t2 <= r.getTMin() ) {
 		return false;
 	}
 
-	if( t1 >= RAY_EPSILON ) {
+	if( t1 >= RAY_EPSILON && t1 > r.getTMin() ) {
+		if( t1 >= r.getTMax() ) {
+			return false;
+		}
+
 		vec3f p( r.at( t1 ) );
 		if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
 			i.t = t1;
@@ -127,6 +139,10 @@ bool Cylinder::intersectCaps( const ray& r, isect& i ) const
 		}
 	}
 
+	if( t2 >= r.getTMax() ) {
+		return false;
+	}
+
 	vec3f p( r.at( t2 ) );
 	if( (p[0]*p[0] + p[1]*p[1]) <= 1.0 ) {
 		i.t = t2;
@@ -15,22 +15,21 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const
 	discriminant = sqrt( discriminant );
 	double t2 = b + discriminant;
 
-	if( t2 <= RAY_EPSILON ) {
+	if( t2 <= RAY_EPSILON || t2 <= r.getTMin() ) {
 		return false;
 	}
 
-	i.obj = this;
-
 	double t1 = b - discriminant;
+	double t = ( t1 > RAY_EPSILON && t1 > r.getTMin() ) ? t1 : t2;
 
-	if( t1 > RAY_EPSILON ) {
-		i.t = t1;
-		i.N = r.at( t1 ).normalize();
-	} else {
-		i.t = t2;
-		i.N = r.at( t2 ).normalize();
+	if( t >= r.getTMax() ) {
+		return false;
 	}
 
+	i.obj = this;
+	i.t = t;
+	i.N = r.at( t ).normalize();
+
 	return true;
 }
 
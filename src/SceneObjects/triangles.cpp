@@ -0,0 +1,295 @@
+#include <cmath>
+#include <float.h>
+
+#include "triangles.h"
+
+#if TRIANGLE_LANES > 1
+using namespace simd;
+#endif
+
+namespace
+{
+
+	// the closest hit so far may be beyond what a float holds
+	inline float clampFloat(double d)
+	{
+		return d < FLT_MAX ? (float)d : FLT_MAX;
+	}
+
+}
+
+TriangleSet::Query::Query(const ray& r)
+{
+	const vec3f d = r.getDirection();
+	const vec3f p = r.getPosition();
+
+	// z is the dimension where the direction is largest; swapping x and y
+	// for negative directions keeps the winding of the triangles
+	kz = 0;
+	if (fabs(d[1]) > fabs(d[kz])) kz = 1;
+	if (fabs(d[2]) > fabs(d[kz])) kz = 2;
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	if (d[kz] < 0.0)
+	{
+		const int tmp = kx;
+		kx = ky;
+		ky = tmp;
+	}
+
+	sx = d[kx] / d[kz];
+	sy = d[ky] / d[kz];
+	sz = 1.0 / d[kz];
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		org[axis] = p[axis];
+		dir[axis] = d[axis];
+	}
+
+	tMin = r.getTMin() > RAY_EPSILON ? r.getTMin() : RAY_EPSILON;
+}
+
+void TriangleSet::clear()
+{
+	for (int vert = 0; vert < 3; ++vert)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+			v[vert][axis].clear();
+	}
+	for (int axis = 0; axis < 3; ++axis)
+		n[axis].clear();
+	normals.clear();
+	count = 0;
+}
+
+void TriangleSet::reserve(int size)
+{
+	for (int vert = 0; vert < 3; ++vert)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+			v[vert][axis].reserve(size + TRIANGLE_LANES - 1);
+	}
+	for (int axis = 0; axis < 3; ++axis)
+		n[axis].reserve(size + TRIANGLE_LANES - 1);
+	normals.reserve(size);
+}
+
+void TriangleSet::add(const vec3f& a, const vec3f& b, const vec3f& c)
+{
+	// there exist some bad triangles such that two vertices coincide;
+	// a zero normal rejects every ray
+	vec3f cv = (b - a).cross(c - a);
+	vec3f normal = cv.iszero() ? vec3f() : cv.normalize();
+	normals.push_back(normal);
+
+	// the new triangle takes the first padding slot, and one more
+	// padding triangle goes on the end
+	const vec3f *verts[3] = { &a, &b, &c };
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (int vert = 0; vert < 3; ++vert)
+		{
+			v[vert][axis].resize(count + TRIANGLE_LANES, 0.0f);
+			v[vert][axis][count] = (float)(*verts[vert])[axis];
+		}
+		n[axis].resize(count + TRIANGLE_LANES, 0.0f);
+		n[axis][count] = (float)normal[axis];
+	}
+	++count;
+}
+
+int TriangleSet::intersect(const Query& q, int first, int num, double& tMax,
+	vec3f& bary) const
+{
+	int best = -1;
+	double t;
+	vec3f b;
+
+#if TRIANGLE_LANES > 1
+	const vfloat ox = vset((float)q.org[q.kx]);
+	const vfloat oy = vset((float)q.org[q.ky]);
+	const vfloat oz = vset((float)q.org[q.kz]);
+	const vfloat sx = vset((float)q.sx);
+	const vfloat sy = vset((float)q.sy);
+	const vfloat sz = vset((float)q.sz);
+	const vfloat dx = vset((float)q.dir[0]);
+	const vfloat dy = vset((float)q.dir[1]);
+	const vfloat dz = vset((float)q.dir[2]);
+	const vfloat lo = vset((float)q.tMin);
+	const vfloat zero = vset(0.0f);
+	const vfloat cull = vset((float)-NORMAL_EPSILON);
+
+	const int end = first + num;
+	for (int k = first; k < end; k += TRIANGLE_LANES)
+	{
+		const vfloat hi = vset(clampFloat(tMax));
+
+		// vertices relative to the ray origin, sheared so the ray runs
+		// along z
+		const vfloat az = vsub(vload(&v[0][q.kz][k]), oz);
+		const vfloat bz = vsub(vload(&v[1][q.kz][k]), oz);
+		const vfloat cz = vsub(vload(&v[2][q.kz][k]), oz);
+		const vfloat ax = vsub(vsub(vload(&v[0][q.kx][k]), ox), vmul(sx, az));
+		const vfloat ay = vsub(vsub(vload(&v[0][q.ky][k]), oy), vmul(sy, az));
+		const vfloat bx = vsub(vsub(vload(&v[1][q.kx][k]), ox), vmul(sx, bz));
+		const vfloat by = vsub(vsub(vload(&v[1][q.ky][k]), oy), vmul(sy, bz));
+		const vfloat cx = vsub(vsub(vload(&v[2][q.kx][k]), ox), vmul(sx, cz));
+		const vfloat cy = vsub(vsub(vload(&v[2][q.ky][k]), oy), vmul(sy, cz));
+
+		// scaled barycentric coordinates: the edge functions
+		const vfloat U = vsub(vmul(cx, by), vmul(cy, bx));
+		const vfloat V = vsub(vmul(ax, cy), vmul(ay, cx));
+		const vfloat W = vsub(vmul(bx, ay), vmul(by, ax));
+		const vfloat det = vadd(vadd(U, V), W);
+		const vfloat T = vmul(sz, vadd(vadd(vmul(U, az), vmul(V, bz)), vmul(W, cz)));
+
+		const vfloat cosine = vadd(vadd(vmul(dx, vload(&n[0][k])),
+			vmul(dy, vload(&n[1][k]))), vmul(dz, vload(&n[2][k])));
+		const vfloat facing = vle(cosine, cull);
+
+		// an edge function of exactly zero is ambiguous in single
+		// precision; those lanes are redone in double
+		const vfloat edge = vand(facing,
+			vor(vor(veq(U, zero), veq(V, zero)), veq(W, zero)));
+		vfloat hit = vandnot(edge, facing);
+		hit = vand(hit, vand(vand(vge(U, zero), vge(V, zero)), vge(W, zero)));
+		hit = vand(hit, vgt(det, zero));
+		hit = vand(hit, vand(vgt(T, vmul(lo, det)), vlt(T, vmul(hi, det))));
+
+		const int valid = (1 << (end - k < TRIANGLE_LANES ? end - k : TRIANGLE_LANES)) - 1;
+		const int hits = vmask(hit) & valid;
+		const int edges = vmask(edge) & valid;
+		if (!hits && !edges)
+			continue;
+
+		float u[TRIANGLE_LANES], vv[TRIANGLE_LANES], w[TRIANGLE_LANES];
+		float d[TRIANGLE_LANES], tt[TRIANGLE_LANES];
+		vstore(u, U);
+		vstore(vv, V);
+		vstore(w, W);
+		vstore(d, det);
+		vstore(tt, T);
+		for (int lane = 0; lane < TRIANGLE_LANES; ++lane)
+		{
+			if (hits & (1 << lane))
+			{
+				const double inv = 1.0 / d[lane];
+				t = tt[lane] * inv;
+				if (t < tMax)
+				{
+					tMax = t;
+					best = k + lane;
+					bary = vec3f(u[lane] * inv, vv[lane] * inv, w[lane] * inv);
+				}
+			}
+			else if ((edges & (1 << lane)) && intersectExact(q, k + lane, tMax, t, b))
+			{
+				tMax = t;
+				best = k + lane;
+				bary = b;
+			}
+		}
+	}
+#else
+	for (int i = first; i < first + num; ++i)
+	{
+		if (intersectOne(q, i, tMax, t, b))
+		{
+			tMax = t;
+			best = i;
+			bary = b;
+		}
+	}
+#endif
+
+	return best;
+}
+
+// The scalar kernel, in single precision like the vector one.
+bool TriangleSet::intersectOne(const Query& q, int i, double tMax, double& t,
+	vec3f& bary) const
+{
+	const float cosine = (float)q.dir[0] * n[0][i] + (float)q.dir[1] * n[1][i]
+		+ (float)q.dir[2] * n[2][i];
+	if (cosine > (float)-NORMAL_EPSILON)
+		return false;
+
+	const float ox = (float)q.org[q.kx];
+	const float oy = (float)q.org[q.ky];
+	const float oz = (float)q.org[q.kz];
+	const float sx = (float)q.sx;
+	const float sy = (float)q.sy;
+
+	const float az = v[0][q.kz][i] - oz;
+	const float bz = v[1][q.kz][i] - oz;
+	const float cz = v[2][q.kz][i] - oz;
+	const float ax = (v[0][q.kx][i] - ox) - sx * az;
+	const float ay = (v[0][q.ky][i] - oy) - sy * az;
+	const float bx = (v[1][q.kx][i] - ox) - sx * bz;
+	const float by = (v[1][q.ky][i] - oy) - sy * bz;
+	const float cx = (v[2][q.kx][i] - ox) - sx * cz;
+	const float cy = (v[2][q.ky][i] - oy) - sy * cz;
+
+	const float U = cx * by - cy * bx;
+	const float V = ax * cy - ay * cx;
+	const float W = bx * ay - by * ax;
+	if (U == 0.0f || V == 0.0f || W == 0.0f)
+		return intersectExact(q, i, tMax, t, bary);
+	if (U < 0.0f || V < 0.0f || W < 0.0f)
+		return false;
+
+	const float det = U + V + W;
+	if (det <= 0.0f)
+		return false;
+
+	const float T = (float)q.sz * (U * az + V * bz + W * cz);
+	if (T <= (float)q.tMin * det || T >= clampFloat(tMax) * det)
+		return false;
+
+	const double inv = 1.0 / det;
+	t = T * inv;
+	if (t >= tMax)
+		return false;
+	bary = vec3f(U * inv, V * inv, W * inv);
+	return true;
+}
+
+// The same test in double precision, for rays that pass exactly through
+// an edge or vertex in single precision.
+bool TriangleSet::intersectExact(const Query& q, int i, double tMax, double& t,
+	vec3f& bary) const
+{
+	if (q.dir[0] * normals[i][0] + q.dir[1] * normals[i][1]
+		+ q.dir[2] * normals[i][2] > -NORMAL_EPSILON)
+		return false;
+
+	const double az = v[0][q.kz][i] - q.org[q.kz];
+	const double bz = v[1][q.kz][i] - q.org[q.kz];
+	const double cz = v[2][q.kz][i] - q.org[q.kz];
+	const double ax = (v[0][q.kx][i] - q.org[q.kx]) - q.sx * az;
+	const double ay = (v[0][q.ky][i] - q.org[q.ky]) - q.sy * az;
+	const double bx = (v[1][q.kx][i] - q.org[q.kx]) - q.sx * bz;
+	const double by = (v[1][q.ky][i] - q.org[q.ky]) - q.sy * bz;
+	const double cx = (v[2][q.kx][i] - q.org[q.kx]) - q.sx * cz;
+	const double cy = (v[2][q.ky][i] - q.org[q.ky]) - q.sy * cz;
+
+	const double U = cx * by - cy * bx;
+	const double V = ax * cy - ay * cx;
+	const double W = bx * ay - by * ax;
+	if (U < 0.0 || V < 0.0 || W < 0.0)
+		return false;
+
+	const double det = U + V + W;
+	if (det <= 0.0)
+		return false;
+
+	const double T = q.sz * (U * az + V * bz + W * cz);
+	if (T <= q.tMin * det || T >= tMax * det)
+		return false;
+
+	const double inv = 1.0 / det;
+	t = T * inv;
+	bary = vec3f(U * inv, V * inv, W * inv);
+	return true;
+}
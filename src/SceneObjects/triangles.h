@@ -0,0 +1,76 @@
+//
+// triangles.h
+//
+// Triangles stored as a structure of arrays, so that the intersection
+// kernel can test TRIANGLE_LANES of them with one SSE or AVX instruction.
+// The kernel is the watertight test of Woop, Benthin and Wald (JCGT 2013):
+// a ray through an edge or vertex shared by several triangles hits at
+// least one of them, which the old per-face test did not guarantee.
+//
+
+#ifndef __TRIANGLES_H__
+#define __TRIANGLES_H__
+
+#include <vector>
+
+#include "../scene/ray.h"
+#include "../vecmath/simd.h"
+
+// the kernel works in single precision
+#define TRIANGLE_LANES SIMD_FLOAT_LANES
+
+class TriangleSet
+{
+public:
+	// Per-ray setup shared by every triangle the ray is tested against.  The
+	// axes are permuted so that the ray mostly runs along z, and the shear
+	// that maps its direction onto the z axis is kept.
+	struct Query
+	{
+		explicit Query(const ray& r);
+
+		int kx, ky, kz;
+		double org[3];
+		double sx, sy, sz;
+		double dir[3];
+		// hits must lie beyond this, as in the other primitives
+		double tMin;
+	};
+
+	TriangleSet() : count(0) {}
+
+	void clear();
+	void reserve(int n);
+
+	// Append the triangle abc.  Only triangles whose normal (b-a)x(c-a)
+	// faces the ray are hit.
+	void add(const vec3f& a, const vec3f& b, const vec3f& c);
+
+	int size() const { return count; }
+
+	// unit normal of triangle i
+	const vec3f& normal(int i) const { return normals[i]; }
+
+	// Closest hit among the triangles [first, first + count) with
+	// q.tMin < t < tMax.  On a hit, tMax is lowered to it, bary receives
+	// the weights of the three vertices, and the triangle is returned;
+	// otherwise -1.
+	int intersect(const Query& q, int first, int count, double& tMax,
+		vec3f& bary) const;
+
+private:
+	bool intersectOne(const Query& q, int i, double tMax, double& t,
+		vec3f& bary) const;
+	bool intersectExact(const Query& q, int i, double tMax, double& t,
+		vec3f& bary) const;
+
+	// v[vertex][axis][triangle], each padded with TRIANGLE_LANES - 1
+	// degenerate triangles so that a block never reads past the end
+	std::vector<float> v[3][3];
+	// unit normals per axis, for rejecting grazing and back faces
+	std::vector<float> n[3];
+	std::vector<vec3f> normals;
+	int count;
+};
+
+#endif // __TRIANGLES_H__
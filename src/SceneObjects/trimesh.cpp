@@ -1,5 +1,5 @@
 #include <cmath>
-#include <float.h>
+#include <algorithm>
 #include "trimesh.h"
 
 Trimesh::~Trimesh()
@@ -34,10 +34,11 @@ bool Trimesh::addFace( int a, int b, int c )
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    Face f;
+    f.ids[0] = a;
+    f.ids[1] = b;
+    f.ids[2] = c;
+    faces.push_back( f );
     return true;
 }
 
@@ -54,94 +55,155 @@ Trimesh::doubleCheck()
     return 0;
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+void Trimesh::bake()
 {
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
-        return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
-        return false;
+    // a mirroring transform turns the winding of the faces around; swap
+    // two corners so that the same side stays in front
+    const Transform& xf = getTransform();
+    vec3f o = xf.localToGlobalCoords( vec3f( 0, 0, 0 ) );
+    vec3f x = xf.localToGlobalCoords( vec3f( 1, 0, 0 ) ) - o;
+    vec3f y = xf.localToGlobalCoords( vec3f( 0, 1, 0 ) ) - o;
+    vec3f z = xf.localToGlobalCoords( vec3f( 0, 0, 1 ) ) - o;
+    if( x.cross( y ) * z < 0.0 )
+    {
+        for( Faces::iterator f = faces.begin(); f != faces.end(); ++f )
+            std::swap( f->ids[1], f->ids[2] );
+    }
+
+    for( Vertices::iterator v = vertices.begin(); v != vertices.end(); ++v )
+        *v = xf.localToGlobalCoords( *v );
+    for( Normals::iterator n = normals.begin(); n != normals.end(); ++n )
+        *n = xf.localToGlobalCoordsNormal( *n );
+
+    baked = true;
+}
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
+void Trimesh::buildHierarchy()
+{
+    vector<BoundingBox> boxes( faces.size() );
+    for( size_t f = 0; f < faces.size(); ++f )
     {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
-        {
-            k = j;
-            greatestMag = val;
-        }
+        const Face &face = faces[f];
+        boxes[f].max = maximum( vertices[face[0]], vertices[face[1]] );
+        boxes[f].min = minimum( vertices[face[0]], vertices[face[1]] );
+
+        boxes[f].max = maximum( vertices[face[2]], boxes[f].max );
+        boxes[f].min = minimum( vertices[face[2]], boxes[f].min );
     }
+    tree.build( boxes, TRIANGLE_LANES );
+
+    // put the faces in leaf order and pack their vertices
+    const vector<int> &order = tree.order();
+    Faces sorted( faces.size() );
+    for( size_t f = 0; f < order.size(); ++f )
+        sorted[f] = faces[order[f]];
+    faces.swap( sorted );
+
+    triangles.clear();
+    triangles.reserve( (int)faces.size() );
+    for( Faces::const_iterator f = faces.begin(); f != faces.end(); ++f )
+        triangles.add( vertices[(*f)[0]], vertices[(*f)[1]], vertices[(*f)[2]] );
+}
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+void Trimesh::ComputeBoundingBox()
+{
+    if( baked )
+        bounds = ComputeLocalBoundingBox();
+    else
+        Geometry::ComputeBoundingBox();
+}
+
+BoundingBox Trimesh::ComputeLocalBoundingBox()
+{
+    BoundingBox localbounds;
+    if( vertices.empty() )
+        return localbounds;
+
+    localbounds.min = localbounds.max = vertices[0];
+    for( Vertices::const_iterator v = vertices.begin(); v != vertices.end(); ++v )
+    {
+        localbounds.max = maximum( *v, localbounds.max );
+        localbounds.min = minimum( *v, localbounds.min );
+    }
+    return localbounds;
+}
+
+// A baked mesh is already in the space of the ray.
+bool Trimesh::intersect( const ray& r, isect& i ) const
+{
+    if( baked )
+        return Trimesh::intersectLocal( r, i );
+
+    return intersectThrough( r, i, [this]( const ray& localRay, isect& hit ) {
+        return Trimesh::intersectLocal( localRay, hit );
+    } );
+}
+
+// Walk the face hierarchy for the closest face, then fill in the normal
+// for that face only.  The material is left to interpolateMaterial().
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    int best = -1;
+    vec3f best_bary;
+    double tMax = r.getTMax();
+    const TriangleSet::Query query( r );
+
+    // faces are in leaf order, so a leaf is the run [first, first + count)
+    auto intersectLeaf = [&]( int first, int count, double &t_closest ) -> bool
+    {
+        int f = triangles.intersect( query, first, count, t_closest, best_bary );
+        if( f < 0 )
+            return false;
+        best = f;
+        return true;
+    };
+    if( !tree.intersectRanges( r, tMax, intersectLeaf ) )
         return false;
 
+    const Face &face = faces[best];
+
     // if we get this far, we have an intersection.  Fill in the info.
-    i.setT( t );
-    if(parent->normals.size())
+    i.setT( tMax );
+    if( normals.size() )
     {
         // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
+        i.setN( (best_bary[0] * normals[face[0]]
+                 + best_bary[1] * normals[face[1]]
+                 + best_bary[2] * normals[face[2]]).normalize() );
     } else {
-        i.setN( n );           // use face normal
+        i.setN( triangles.normal( best ) );     // use face normal
     }
     i.obj = this;
+    i.bary = best_bary;
+    i.face = best;
 
-    // linearly interpolate materials
-    if( parent->materials.size() )
-    {
-        Material *m = new Material();
-        for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
-        i.setMaterial( m );
-    }
-    
     return true;
 }
 
+// linearly interpolate materials
+bool Trimesh::interpolateMaterial( const isect& i, Material& m ) const
+{
+    if( materials.empty() )
+        return false;
+
+    const Face &face = faces[ i.face ];
+    m = Material();
+    for( int jj = 0; jj < 3; ++jj )
+        m += i.bary[jj] * (*materials[ face[jj] ]);
+    return true;
+}
+
+// with per-vertex materials, any of them that transmits
+bool Trimesh::transmits() const
+{
+    if( materials.empty() )
+        return MaterialSceneObject::transmits();
+    for( auto *m : materials )
+        if( !m->kt.iszero() )
+            return true;
+    return false;
+}
+
 void
 Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
@@ -154,16 +216,16 @@ Trimesh::generateNormals()
     
     for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
+        vec3f a = vertices[(*fi)[0]];
+        vec3f b = vertices[(*fi)[1]];
+        vec3f c = vertices[(*fi)[2]];
         
         vec3f faceNormal = ((b-a).cross(c-a)).normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[(*fi)[i]] += faceNormal;
+            ++numFaces[(*fi)[i]];
         }
     }
 
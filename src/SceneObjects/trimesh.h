@@ -7,28 +7,56 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
+#include "../scene/bvh.h"
+#include "triangles.h"
 
+// A triangle mesh is a single scene object.  Its faces are only vertex
+// index triples, and rays are tested against them through a hierarchy
+// built in the mesh's own coordinate space, so the ray is transformed once
+// per mesh instead of once per face.  Once the hierarchy is built, the
+// faces are kept in its leaf order, and their vertices are copied into a
+// TriangleSet in the same order so that each leaf is one run of
+// triangles for the vector kernel.
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
+public:
+    struct Face
+    {
+        int ids[3];
+
+        int operator[]( int i ) const
+        {
+            return ids[i];
+        }
+    };
+
+private:
     typedef vector<vec3f> Normals;
     typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
+    typedef vector<Face> Faces;
     typedef vector<Material*> Materials;
     Vertices vertices;
     Faces faces;
     Normals normals;
     Materials materials;
+
+    // bottom-level hierarchy over the faces, in local coordinates
+    BVH tree;
+    // the vertices of faces[i] are triangle i
+    TriangleSet triangles;
+
+    // vertices and normals are already in the space of the transform root
+    bool baked;
+
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat)
+        : MaterialSceneObject(scene, mat), baked( false )
     {
-        this->transform = transform;
+        setTransform( transform );
     }
 
     ~Trimesh();
-    
+
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const vec3f & );
     void addMaterial( Material *m );
@@ -37,44 +65,28 @@ public:
     bool addFace( int a, int b, int c );
 
     char *doubleCheck();
-    
+
     void generateNormals();
-};
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-    }
+    // Apply the transform to the vertices and normals once, so that rays
+    // are tested as they are instead of being brought into the mesh's
+    // space for every test.  Call after the normals, before the hierarchy.
+    void bake();
 
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
+    // Build the face hierarchy.  Call once all faces have been added.
+    void buildHierarchy();
 
+    virtual bool intersect( const ray& r, isect& i ) const;
     virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+    // blend the per-vertex materials, if there are any
+    virtual bool interpolateMaterial( const isect& i, Material& m ) const;
+    virtual bool transmits() const;
+
     virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
-    {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
-    }
-    
+
+    virtual void ComputeBoundingBox();
+    virtual BoundingBox ComputeLocalBoundingBox();
 };
 
 
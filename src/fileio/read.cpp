@@ -13,6 +13,7 @@
 #include "parse.h"
 
 #include "../scene/scene.h"
+#include "../scene/instance.h"
 #include "../SceneObjects/trimesh.h"
 #include "../SceneObjects/Box.h"
 #include "../SceneObjects/Cone.h"
@@ -29,9 +30,11 @@ static Obj *getField( Obj *obj, const string& name );
 static bool hasField( Obj *obj, const string& name );
 static vec3f tupleToVec( Obj *obj );
 static void processGeometry( string name, Obj *child, Scene *scene,
-	const mmap& materials, TransformNode *transform );
+	const mmap& materials, TransformNode *transform, Prototype *proto );
 static void processTrimesh( string name, Obj *child, Scene *scene,
-                                     const mmap& materials, TransformNode *transform );
+                                     const mmap& materials, TransformNode *transform,
+                                     Prototype *proto );
+static void processDefinition( Obj *child, Scene *scene, const mmap& materials );
 static void processCamera( Obj *child, Scene *scene );
 static Material *getMaterial( Obj *child, const mmap& bindings );
 static Material *processMaterial( Obj *child, mmap *bindings = NULL );
@@ -98,8 +101,13 @@ Scene *readScene( istream& is )
 
 		processObject( cur, ret, materials );
 		delete cur;
+
+		// the objects just read have their entries in ret->transforms
+		ret->transformRoot.releaseChildren();
 	}
 
+	ret->transforms.compact();
+
 	return ret;
 }
 
@@ -163,7 +171,7 @@ static vec3f tupleToVec( Obj *obj )
 }
 
 static void processGeometry( Obj *obj, Scene *scene,
-	const mmap& materials, TransformNode *transform )
+	const mmap& materials, TransformNode *transform, Prototype *proto )
 {
 	string name;
 	Obj *child; 
@@ -182,7 +190,7 @@ static void processGeometry( Obj *obj, Scene *scene,
 		throw ParseError( string( oss.str() ) );
 	}
 
-	processGeometry( name, child, scene, materials, transform );
+	processGeometry( name, child, scene, materials, transform, proto );
 }
 
 // Extract the named scalar field into ret, if it exists.
@@ -220,8 +228,19 @@ static void verifyTuple( const mytuple& tup, size_t size )
 	}
 }
 
+// Geometry read inside a definition goes to its prototype rather than
+// straight into the scene.
+static void addGeometry( Scene *scene, Prototype *proto, Geometry *obj )
+{
+	if( proto ) {
+		proto->add( obj );
+	} else {
+		scene->add( obj );
+	}
+}
+
 static void processGeometry( string name, Obj *child, Scene *scene,
-	const mmap& materials, TransformNode *transform )
+	const mmap& materials, TransformNode *transform, Prototype *proto )
 {
 	if( name == "translate" ) {
 		const mytuple& tup = child->getTuple();
@@ -231,7 +250,8 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                          materials,
                          transform->createChild(mat4f::translate( vec3f(tup[0]->getScalar(), 
                                                                         tup[1]->getScalar(), 
-                                                                        tup[2]->getScalar() ) ) ) );
+                                                                        tup[2]->getScalar() ) ) ),
+                         proto );
 	} else if( name == "rotate" ) {
 		const mytuple& tup = child->getTuple();
 		verifyTuple( tup, 5 );
@@ -241,7 +261,8 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                          transform->createChild(mat4f::rotate( vec3f(tup[0]->getScalar(),
                                                                      tup[1]->getScalar(),
                                                                      tup[2]->getScalar() ),
-                                                               tup[3]->getScalar() ) ) );
+                                                               tup[3]->getScalar() ) ),
+                         proto );
 	} else if( name == "scale" ) {
 		const mytuple& tup = child->getTuple();
 		if( tup.size() == 2 ) {
@@ -249,7 +270,8 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 			processGeometry( tup[1],
                              scene,
                              materials,
-                             transform->createChild(mat4f::scale( vec3f( sc, sc, sc ) ) ) );
+                             transform->createChild(mat4f::scale( vec3f( sc, sc, sc ) ) ),
+                             proto );
 		} else {
 			verifyTuple( tup, 4 );
 			processGeometry( tup[3],
@@ -257,7 +279,8 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                              materials,
                              transform->createChild(mat4f::scale( vec3f(tup[0]->getScalar(),
                                                                         tup[1]->getScalar(),
-                                                                        tup[2]->getScalar() ) ) ) );
+                                                                        tup[2]->getScalar() ) ) ),
+                             proto );
 		}
 	} else if( name == "transform" ) {
 		const mytuple& tup = child->getTuple();
@@ -290,9 +313,22 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                       vec4f( l4[0]->getScalar(),
                                                              l4[1]->getScalar(),
                                                              l4[2]->getScalar(),
-                                                             l4[3]->getScalar() ) ) ) );
+                                                             l4[3]->getScalar() ) ) ),
+                         proto );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
-        processTrimesh( name, child, scene, materials, transform);
+        processTrimesh( name, child, scene, materials, transform, proto );
+    } else if( name == "instance" ) {
+		const Prototype *prototype = NULL;
+		if( hasField( child, "name" ) ) {
+			Obj *field = getField( child, "name" );
+			prototype = scene->getPrototype( field->getTypeName() == "id"
+				? field->getID() : field->getString() );
+		}
+		if( prototype == NULL ) {
+			throw ParseError( "Instance of an undefined object" );
+		}
+
+		addGeometry( scene, proto, new Instance( scene, prototype, transform ) );
     } else {
 		SceneObject *obj = NULL;
        	Material *mat;
@@ -325,12 +361,13 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 		}
 
         obj->setTransform(transform);
-		scene->add(obj);
+		addGeometry( scene, proto, obj );
 	}
 }
 
 static void processTrimesh( string name, Obj *child, Scene *scene,
-                                     const mmap& materials, TransformNode *transform )
+                                     const mmap& materials, TransformNode *transform,
+                                     Prototype *proto )
 {
     Material *mat;
     
@@ -389,7 +426,48 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
 
-    scene->add(tmesh);
+    // meshes are moved out of their own space once here unless asked not
+    // to, which saves transforming every ray that reaches them
+    bool bake = true;
+    maybeExtractField( child, "bake", bake );
+    if( bake )
+        tmesh->bake();
+
+    tmesh->buildHierarchy();
+    addGeometry( scene, proto, tmesh );
+}
+
+// A definition names a group of objects that can then be placed any number
+// of times with "instance".  The objects are read once, in the definition's
+// own coordinate space:
+//
+//   define { name = tree; objects = ( polymesh { ... }, translate( ... ) ); }
+//   translate( 10, 0, 0, instance { name = tree; } )
+static void processDefinition( Obj *child, Scene *scene, const mmap& materials )
+{
+	if( child == NULL || !hasField( child, "name" ) ) {
+		throw ParseError( "Attempt to define an object with no name" );
+	}
+
+	Obj *field = getField( child, "name" );
+	string name = field->getTypeName() == "id" ? field->getID() : field->getString();
+	if( scene->getPrototype( name ) != NULL ) {
+		throw ParseError( string( "Object defined twice: " ) + name );
+	}
+
+	Prototype *proto = new Prototype;
+	Obj *objects = getField( child, "objects" );
+	if( objects->getTypeName() == "tuple" ) {
+		const mytuple& tup = objects->getTuple();
+		for( mytuple::const_iterator oi = tup.begin(); oi != tup.end(); ++oi )
+			processGeometry( *oi, scene, materials, &proto->transformRoot, proto );
+	} else {
+		processGeometry( objects, scene, materials, &proto->transformRoot, proto );
+	}
+
+	proto->build();
+	proto->transformRoot.releaseChildren();
+	scene->addPrototype( name, proto );
 }
 
 static Material *getMaterial( Obj *child, const mmap& bindings )
@@ -542,9 +620,12 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 				name == "scale" ||
 				name == "transform" ||
                 name == "trimesh" ||
-                name == "polymesh") { // polymesh is for backwards compatibility.
-		processGeometry( name, child, scene, materials, &scene->transformRoot);
+                name == "polymesh" || // polymesh is for backwards compatibility.
+                name == "instance") {
+		processGeometry( name, child, scene, materials, &scene->transformRoot, NULL );
 		//scene->add( geo );
+	} else if( name == "define" ) {
+		processDefinition( child, scene, materials );
 	} else if( name == "material" ) {
 		processMaterial( child, &materials );
 	} else if( name == "camera" ) {
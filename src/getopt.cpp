@@ -56,6 +56,16 @@
 char* optarg = NULL;
 int optind, opterr, optopt;
 
+// '/' starts an option only on Windows; elsewhere it starts absolute paths
+static bool IsOptionStart(char ch)
+{
+#ifdef WIN32
+    return ch == '-' || ch == '/';
+#else
+    return ch == '-';
+#endif
+}
+
 int GetOption (
     int argc,
     char** argv,
@@ -70,7 +80,7 @@ int GetOption (
     if (iArg < argc)
     {
         psz = &(argv[iArg][0]);
-        if (*psz == '-' || *psz == '/')
+        if (IsOptionStart(*psz))
         {
             // we have an option specifier
             chOpt = argv[iArg][1];
@@ -91,7 +101,7 @@ int GetOption (
                             if (iArg+1 < argc)
                             {
                                 psz = &(argv[iArg+1][0]);
-                                if (*psz == '-' || *psz == '/')
+                                if (IsOptionStart(*psz))
                                 {
                                     // next argv is a new option, so param
                                     // not given for current option
@@ -13,34 +13,42 @@
 //  |
 //  +- RayTracer::traceSetup
 //  |
-//  +- RayTracer::traceLines
+//  +- RayTracer::traceImage
 //        |
-//        +- RayTracer::tracePixel
+//        +- RayTracer::tracePixels
 //              |
-//              +- RayTracer::trace
+//              +- RayTracer::traceBlock
 //                    |
-//                    +- Camera::rayThrough
+//                    +- Camera::raysThrough
 //                    |
-//                    +- RayTracer::traceRay
-//                          |
-//                          +- Scene::intersect
-//                          |     |
-//                          |     +- <Geometry>::intersect
-//                          |           |
-//                          |           +- <Geometry>::intersectLocal
+//                    +- Scene::intersectPacket
+//                    |     |
+//                    |     +- <Geometry>::intersect
+//                    |           |
+//                    |           +- <Geometry>::intersectLocal
+//                    |
+//                    +- RayTracer::shadeHit
 //                          |
 //                          +- isect::getMaterial
 //                          |
-//                          +- Material::shade
+//                          +- Material::shadeWith
+//                          |
+//                          +- RayTracer::traceRay (reflection and refraction)
 //
 // The loadScene and traceSetup methods load a file and set up all the internal
-// buffers necessary to render the scene.  The traceLines method begins the
-// process of actually rendering the image, one scanline at a time.  It does
-// this by calling tracePixel for each pixel in the image.  tracePixel is given
-// a coordinate pair which is converted into an (x,y) screen coordinate and
-// passed to trace.  The trace method calculates a ray from the camera position
-// through the (x,y) coordinate and then calls traceRay to see if this ray
-// actually intersects any objects in the scene.  The intersect method in
+// buffers necessary to render the scene.  The traceImage method begins the
+// process of actually rendering the image, one small tile at a time on a
+// pool of worker threads.  It does this by calling tracePixels for each 8x8
+// block of each tile.  tracePixels hands traceBlock the block's pixels, whose
+// (x,y) screen coordinates go to raysThrough.  That calculates a packet of
+// rays from the camera position through the (x,y) coordinates, and
+// intersectPacket sees which objects in the scene they actually intersect,
+// sharing the work between rays that pass through the same boxes.  Later
+// rays, reflected and refracted, go one at a time through traceRay, which
+// calls Scene::intersect; with the wavefront integrator (-b) traceBlock
+// instead follows the whole packet one bounce at a time in
+// traceWavefront, shading each wave's hits and tracing their shadow rays
+// together.  The intersect method in
 // Scene calls intersect on each object in the scene (part of your assignment
 // is an acceleration or culling process that cuts this down significantly).
 // Each object in the scene is a descendant of Geometry and has its own
@@ -55,7 +63,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <chrono>
 
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
@@ -67,6 +78,7 @@
 #include "RayTracer.h"
 
 #include "fileio/bitmap.h"
+#include "scene/stats.h"
 
 // ***********************************************************
 // from getopt.cpp 
@@ -83,45 +95,196 @@ TraceUI* traceUI;
 //
 // options from program parameters
 //
-int recursion_depth = 0;
-int g_height;
-int g_width = 150;
+RenderSettings g_settings;
+int g_height = 0;
+const int kDefaultWidth = 150;
+int g_width = kDefaultWidth;
+int g_workers = RenderPool::defaultWorkers();
 bool bReport = false;
-char *progname, *rayName, *imgName;
+char *progname, *rayName, *imgName, *heatName = NULL;
 
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [options] [input.ray output.bmp]\n"
+		"run it with -? on a console for the options", progname );
 #else
+	const RenderSettings defaults;
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
-	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
-	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
-	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", defaults.depth );
+	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", kDefaultWidth );
+	fprintf( stderr, "  -h <#>      set output image height (default from the camera's aspect)\n" );
+	fprintf( stderr, "  -j <#>      set number of render threads (default %d)\n", RenderPool::defaultWorkers() );
+	fprintf( stderr, "  -s <#>      supersample <#>x<#> rays per pixel (default off)\n" );
+	fprintf( stderr, "  -a <#>      adaptive supersampling threshold (default %g, off)\n", defaults.adaptiveThreshold );
+	fprintf( stderr, "  -p          trace one sample per pixel per pass\n" );
+	fprintf( stderr, "  -b          trace breadth-first, a bounce at a time (wavefront)\n" );
+	fprintf( stderr, "  -m <name>   sampler: random, halton or sobol (default %s)\n", Sampler::Name( defaults.sampler ) );
+	fprintf( stderr, "  -g <#>      glossy reflection rays (default %d, mirror)\n", defaults.glossySamples );
+	fprintf( stderr, "  -S <#>      soft shadows with <#> rays per light (default off)\n" );
+	fprintf( stderr, "  -f <#>      Fresnel weight 0..1 (default off)\n" );
+	fprintf( stderr, "  -i <#>      intensity threshold (default %g)\n", defaults.intensityThreshold );
+	fprintf( stderr, "  -d <c,l,q>  distance attenuation for every light (default the scene's)\n" );
+	fprintf( stderr, "  -x <flags>  switch off s shadows, r reflection, t refraction, c occluder cache,\n"
+		"              b ray binning (with -b)\n" );
+	fprintf( stderr, "  -H <file>   write the samples taken per pixel as a heatmap\n" );
+	fprintf( stderr, "  -t          report time statistics\n" );
 #endif
 }
 
+// a whole number of at least least
+bool parseCount(const char *arg, int &value, int least = 1)
+{
+	char *end;
+	const long v = strtol(arg, &end, 10);
+	if (end == arg || *end || v < least || v > INT_MAX)
+		return false;
+	value = (int)v;
+	return true;
+}
+
+// a number from lo to hi
+bool parseAmount(const char *arg, double &value, double lo, double hi)
+{
+	char *end;
+	const double v = strtod(arg, &end);
+	if (end == arg || *end || !(v >= lo && v <= hi))
+		return false;
+	value = v;
+	return true;
+}
+
+bool parseSampler(const char *name, Sampler::Kind &kind)
+{
+	for (int k = 0; k < Sampler::kNumKinds; ++k)
+	{
+		const char *s = Sampler::Name((Sampler::Kind)k);
+		const char *n = name;
+		while (*s && tolower(*s) == tolower(*n))
+			++s, ++n;
+		if (!*s && !*n)
+		{
+			kind = (Sampler::Kind)k;
+			return true;
+		}
+	}
+	return false;
+}
+
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tpbr:w:h:j:s:a:m:g:S:f:i:d:x:H:" )) != EOF )
 	{
+		if ( i != 't' && i != 'p' && i != 'b' && !optarg )
+		{
+			fprintf( stderr, "-%c needs a value.\n", i );
+			return false;
+		}
+
 		switch ( i )
 		{
 			case 't':
 			bReport = true;
 			break;
 	    
+			case 'p':
+			g_settings.progressive = true;
+			break;
+
+			case 'b':
+			g_settings.wavefront = true;
+			break;
+
 			case 'r':
-			recursion_depth = atoi( optarg );
+			case 's':
+			case 'g':
+			if ( !parseCount( optarg, i == 'r' ? g_settings.depth
+				: i == 's' ? g_settings.superSampling : g_settings.glossySamples, 0 ) )
+			{
+				fprintf( stderr, "-%c takes a whole number of at least 0.\n", i );
+				return false;
+			}
 			break;
 	    
 			case 'w':
-			g_width = atoi( optarg );
-			break;
-	    
 			case 'h':
-			g_height = atoi( optarg );
+			case 'j':
+			if ( !parseCount( optarg, i == 'w' ? g_width
+				: i == 'h' ? g_height : g_workers ) )
+			{
+				fprintf( stderr, "-%c takes a whole number of at least 1.\n", i );
+				return false;
+			}
+			break;
+
+			case 'a':
+			g_settings.adaptiveThreshold = atof( optarg );
+			break;
+
+			case 'm':
+			if ( !parseSampler( optarg, g_settings.sampler ) )
+			{
+				fprintf( stderr, "unknown sampler %s.\n", optarg );
+				return false;
+			}
+			break;
+
+			case 'S':
+			if ( !parseCount( optarg, g_settings.softShadowSamples ) )
+			{
+				fprintf( stderr, "-%c takes a whole number of at least 1.\n", i );
+				return false;
+			}
+			g_settings.softShadows = true;
+			break;
+
+			case 'f':
+			if ( !parseAmount( optarg, g_settings.fresnelRatio, 0.0, 1.0 ) )
+			{
+				fprintf( stderr, "-f takes a weight from 0 to 1.\n" );
+				return false;
+			}
+			g_settings.fresnel = true;
+			break;
+
+			case 'i':
+			if ( !parseAmount( optarg, g_settings.intensityThreshold, 0.0, HUGE_VAL ) )
+			{
+				fprintf( stderr, "-i takes a number of at least 0.\n" );
+				return false;
+			}
+			break;
+
+			case 'd':
+			if ( sscanf( optarg, "%lf,%lf,%lf", &g_settings.distanceConstant,
+				&g_settings.distanceLinear, &g_settings.distanceQuadratic ) != 3 )
+			{
+				fprintf( stderr, "-d takes constant,linear,quadratic.\n" );
+				return false;
+			}
+			g_settings.overrideDistance = true;
+			break;
+
+			case 'x':
+			for ( const char *c = optarg; *c; ++c )
+			{
+				switch ( *c )
+				{
+					case 's': g_settings.shadows = false; break;
+					case 'r': g_settings.reflection = false; break;
+					case 't': g_settings.refraction = false; break;
+					case 'c': g_settings.occluderCache = false; break;
+					case 'b': g_settings.binRays = false; break;
+					default:
+					fprintf( stderr, "-x does not know %c.\n", *c );
+					return false;
+				}
+			}
+			break;
+
+			case 'H':
+			heatName = optarg;
 			break;
 
 			default:
@@ -147,6 +310,10 @@ bool processArgs(int argc, char **argv) {
 // OK. I am lying. any illegal option such as "ray blahbalh" will print
 // out the usage
 //
+// Text mode makes no FLTK calls outside Windows, where there is no console
+// to print to, so it runs on machines without a display.  It takes every
+// setting the GUI has and renders on all cores unless told otherwise.
+//
 // Graphics mode will be substantially slower than text mode because of
 // event handling overhead.
 int main(int argc, char **argv) {
@@ -160,38 +327,48 @@ int main(int argc, char **argv) {
 		}
 		
 		theRayTracer=new RayTracer();
-		theRayTracer->loadScene(rayName);
-	
-		if (theRayTracer->sceneLoaded()) {
+		if (!theRayTracer->loadScene(rayName)) {
+			fprintf( stderr, "couldn't load %s.\n", rayName );
+			return 1;
+		}
+
+		if (g_height <= 0)
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
-			theRayTracer->traceSetup(g_width, g_height);
+		theRayTracer->traceSetup(g_width, g_height, g_settings);
 		
-			clock_t start, end;
-			start=clock();
+		renderStats.reset();
+		const auto start = std::chrono::steady_clock::now();
 
-			theRayTracer->traceLines(0, g_height);
+		theRayTracer->traceImage(g_workers);
 		
-			end=clock();
+		const std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
 
-			// save image
-			unsigned char* buf;
+		// save image
+		unsigned char* buf;
 
-			theRayTracer->getBuffer(buf, g_width, g_height);
-			if (buf)
-				writeBMP(imgName, g_width, g_height, buf); 
+		theRayTracer->getBuffer(buf, g_width, g_height);
+		if (buf)
+			writeBMP(imgName, g_width, g_height, buf); 
 
-			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
+		if (heatName) {
+			theRayTracer->getSampleHeatmap(buf, g_width, g_height);
+			writeBMP(heatName, g_width, g_height, buf);
+		}
+
+		if (bReport) {
+			double t=elapsed.count();
 #ifdef WIN32
-				fl_message( "total time = %.3f seconds\n", t); 
+			fl_message( "total time = %.3f seconds on %d threads\n%s\n", t,
+				g_workers, renderStats.summary().c_str() );
 #else
-				fprintf( stderr, "total time = %.3f seconds\n", t); 
+			fprintf( stderr, "total time = %.3f seconds on %d threads\n", t, g_workers ); 
+			fprintf( stderr, "%s\n", renderStats.summary().c_str() );
 #endif
-			}
 		}
 
-		return 1;
+		return 0;
 	} else {
 		// graphics mode
 		traceUI=new TraceUI();
@@ -0,0 +1,65 @@
+//
+// sampleRng.h
+//
+// Counter-based random numbers for sampling.  A stream is named by a
+// 64-bit key and its n-th number is a hash of the key and n, so there is
+// no state shared between threads and no order in which they must draw.
+// The key of a camera sample is made from its pixel and sample index, and
+// each ray spawned below it gets a key made from its parent's and the
+// branch it was spawned on.  Every number a path uses therefore depends
+// only on where it is in the image and in the ray tree, and a render
+// comes out the same whichever thread traces which tile.
+//
+// The hash is the finaliser of SplitMix64, which passes BigCrush when fed
+// consecutive counters.
+//
+
+#ifndef SAMPLE_RNG_H_
+#define SAMPLE_RNG_H_
+
+class SampleRng
+{
+public:
+	typedef unsigned long long Key;
+
+	explicit SampleRng(Key key) : m_key(key), m_counter(0) {}
+
+	// The key of stream number n under key: a pixel's samples, or the
+	// rays spawned at a hit.
+	static Key Derive(Key key, Key n)
+	{
+		return mix(key ^ mix(n + kGolden));
+	}
+
+	// uniform on [0, 1), with 53 random bits
+	double Uniform()
+	{
+		return (Next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// the key of a fresh stream, independent of the numbers drawn here
+	Key Split()
+	{
+		return Next();
+	}
+
+private:
+	static const Key kGolden = 0x9e3779b97f4a7c15ull;
+
+	static Key mix(Key z)
+	{
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	Key Next()
+	{
+		return mix(m_key + ++m_counter * kGolden);
+	}
+
+	Key m_key;
+	Key m_counter;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "sampler.h"
+
+namespace
+{
+
+	// The patterns draw their scrambles from this stream under their key,
+	// which is not a branch any ray is spawned on.
+	const SampleRng::Key kPatternStream = ~0ull;
+
+	// the seed of dimension dim of the pattern under key; dimension -1
+	// shuffles the order of the points
+	unsigned DimensionSeed(SampleRng::Key key, int dim)
+	{
+		return (unsigned)SampleRng::Derive(
+			SampleRng::Derive(key, kPatternStream), (SampleRng::Key)(dim + 1));
+	}
+
+	class RandomSampler : public Sampler
+	{
+	public:
+		virtual void Generate(SampleRng::Key key, unsigned index, int dims,
+			double *point) const
+		{
+			SampleRng rng(SampleRng::Derive(
+				SampleRng::Derive(key, kPatternStream), index));
+			for (int d = 0; d < dims; ++d)
+				point[d] = rng.Uniform();
+		}
+	};
+
+	class HaltonSampler : public Sampler
+	{
+	public:
+		virtual void Generate(SampleRng::Key key, unsigned index, int dims,
+			double *point) const
+		{
+			static const unsigned kBases[kMaxDimensions] = { 2, 3, 5 };
+			for (int d = 0; d < dims; ++d)
+			{
+				// a random toroidal shift of the whole pattern
+				const double shift = DimensionSeed(key, d) * (1.0 / 4294967296.0);
+				const double x = RadicalInverse(kBases[d], index) + shift;
+				point[d] = x < 1.0 ? x : x - 1.0;
+			}
+		}
+
+	private:
+		// index with its digits in base mirrored about the radix point
+		static double RadicalInverse(unsigned base, unsigned index)
+		{
+			const double inv_base = 1.0 / base;
+			double scale = inv_base;
+			double x = 0.0;
+			for (; index > 0; index /= base, scale *= inv_base)
+				x += (index % base) * scale;
+			return x;
+		}
+	};
+
+	// Owen-scrambled Sobol points after Burley, "Practical Hash-based Owen
+	// Scrambling" (JCGT 2020).  The scramble is a hash that flips each bit
+	// of a coordinate depending only on the bits above it, as a nested
+	// uniform scramble does, and the point order is shuffled the same way.
+	class SobolSampler : public Sampler
+	{
+	public:
+		SobolSampler()
+		{
+			// primitive polynomials and initial direction numbers of the
+			// first dimensions from Joe and Kuo; the first is the van der
+			// Corput sequence
+			static const unsigned kDegree[kMaxDimensions] = { 1, 1, 2 };
+			static const unsigned kCoefficients[kMaxDimensions] = { 0, 0, 1 };
+			static const unsigned kInitial[kMaxDimensions][2] = { { 1 }, { 1 }, { 1, 3 } };
+
+			for (int d = 0; d < kMaxDimensions; ++d)
+			{
+				const unsigned s = kDegree[d];
+				unsigned m[32];
+				for (unsigned k = 0; k < 32; ++k)
+				{
+					if (d == 0)
+						m[k] = 1;
+					else if (k < s)
+						m[k] = kInitial[d][k];
+					else
+					{
+						m[k] = m[k - s] ^ (m[k - s] << s);
+						for (unsigned j = 1; j < s; ++j)
+						{
+							if (kCoefficients[d] >> (s - 1 - j) & 1)
+								m[k] ^= m[k - j] << j;
+						}
+					}
+					directions[d][k] = m[k] << (31 - k);
+				}
+			}
+		}
+
+		virtual void Generate(SampleRng::Key key, unsigned index, int dims,
+			double *point) const
+		{
+			const unsigned shuffled = Scramble(index, DimensionSeed(key, -1));
+			for (int d = 0; d < dims; ++d)
+			{
+				point[d] = Scramble(Sobol(shuffled, d), DimensionSeed(key, d))
+					* (1.0 / 4294967296.0);
+			}
+		}
+
+	private:
+		// The shuffled indices are random, so a branch on each of their
+		// bits would be mispredicted half the time; a mask costs less.
+		unsigned Sobol(unsigned index, int dim) const
+		{
+			unsigned x = 0;
+			for (int bit = 0; index != 0; ++bit, index >>= 1)
+				x ^= directions[dim][bit] & (0u - (index & 1));
+			return x;
+		}
+
+		static unsigned ReverseBits(unsigned x)
+		{
+			x = (x << 16) | (x >> 16);
+			x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+			x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+			x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+			x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+			return x;
+		}
+
+		// Laine and Karras' hash, which only carries from low bits to high
+		// ones; with the bits reversed around it each bit depends only on
+		// the more significant ones
+		static unsigned Scramble(unsigned x, unsigned seed)
+		{
+			x = ReverseBits(x);
+			x += seed;
+			x ^= x * 0x6c50b47cu;
+			x ^= x * 0xb82f1e52u;
+			x ^= x * 0xc7afe638u;
+			x ^= x * 0x8d22f6e6u;
+			return ReverseBits(x);
+		}
+
+		unsigned directions[kMaxDimensions][32];
+	};
+
+}
+
+const Sampler &Sampler::Get(Kind kind)
+{
+	static const RandomSampler random;
+	static const HaltonSampler halton;
+	static const SobolSampler sobol;
+
+	switch (kind)
+	{
+	case kRandom:
+		return random;
+	case kHalton:
+		return halton;
+	default:
+		return sobol;
+	}
+}
+
+const char *Sampler::Name(Kind kind)
+{
+	static const char *const kNames[kNumKinds] = { "Random", "Halton", "Sobol" };
+	return kind >= 0 && kind < kNumKinds ? kNames[kind] : kNames[kSobol];
+}
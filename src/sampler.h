@@ -0,0 +1,47 @@
+//
+// sampler.h
+//
+// Sample patterns for the effects that average over many rays: pixel
+// supersampling, glossy reflection and soft shadows.  Each asks for point
+// k of a pattern of n in the unit square or cube, and the pattern is named
+// by a SampleRng key, so it depends only on where in the image and in the
+// ray tree it is used.
+//
+// Random points clump and leave gaps, so the mean of n of them converges
+// as 1/sqrt(n).  Halton and Sobol points fill the domain evenly, which for
+// the smooth integrands here converges nearly as 1/n.  Each pattern is
+// scrambled afresh for every key, so neighbouring pixels do not share their
+// structure, and every dimension is scrambled with its own seed, so the
+// dimensions are not correlated with each other either.
+//
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include "sampleRng.h"
+
+class Sampler
+{
+public:
+	enum Kind
+	{
+		kRandom,	// independent uniform points
+		kHalton,	// Halton in bases 2, 3, 5, randomly rotated
+		kSobol,		// Sobol, Owen-scrambled and shuffled
+		kNumKinds
+	};
+
+	static const int kMaxDimensions = 3;
+
+	virtual ~Sampler() {}
+
+	// Point index of the pattern named by key, written to point[0, dims).
+	// Every coordinate is in [0, 1).
+	virtual void Generate(SampleRng::Key key, unsigned index, int dims,
+		double *point) const = 0;
+
+	static const Sampler &Get(Kind kind);
+	static const char *Name(Kind kind);
+};
+
+#endif
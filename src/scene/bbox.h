@@ -0,0 +1,50 @@
+//
+// bbox.h
+//
+// Axis-aligned bounding boxes, shared by the scene and the bounding
+// volume hierarchy built over it.
+//
+
+#ifndef __BBOX_H__
+#define __BBOX_H__
+
+#include "ray.h"
+#include "../vecmath/vecmath.h"
+
+class BoundingBox
+{
+public:
+	vec3f min;
+	vec3f max;
+
+	void operator=(const BoundingBox& target);
+
+	// Does this bounding box intersect the target?
+	bool intersects(const BoundingBox &target) const;
+
+	// does the box contain this point?
+	bool intersects(const vec3f& point) const;
+
+	// if the ray hits the box, put the "t" value of the intersection
+	// closest to the origin in tMin and the "t" value of the far intersection
+	// in tMax and return true, else return false.
+	bool intersect(const ray& r, double& tMin, double& tMax) const;
+
+	// grow this box so that it also encloses the target
+	void merge(const BoundingBox& target)
+	{
+		min = minimum(min, target.min);
+		max = maximum(max, target.max);
+	}
+
+	vec3f center() const { return (min + max) * 0.5; }
+
+	// surface area of the box, used by the SAH cost model.
+	double area() const
+	{
+		const vec3f e = max - min;
+		return 2.0 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+	}
+};
+
+#endif // __BBOX_H__
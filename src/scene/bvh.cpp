@@ -0,0 +1,196 @@
+#include <algorithm>
+
+#include "bvh.h"
+
+namespace
+{
+
+	// Relative costs of the SAH: visiting a node versus intersecting one
+	// primitive.  Primitive tests go through a matrix transform, so they are
+	// considerably more expensive than a slab test.
+	const double kTraversalCost = 1.0;
+	const double kIntersectCost = 2.0;
+
+	const int kBins = 16;
+	const int kMaxLeafSize = 8;
+	// keep the tree within the traversal stack of BVH::intersect
+	const int kMaxDepth = 56;
+
+	struct Bin
+	{
+		BoundingBox bounds;
+		int count;
+	};
+
+	void growBounds(BoundingBox& b, bool& empty, const BoundingBox& box)
+	{
+		if (empty)
+		{
+			b = box;
+			empty = false;
+		}
+		else
+		{
+			b.merge(box);
+		}
+	}
+
+}
+
+void BVH::build(const std::vector<BoundingBox>& boxes, int leafWidth)
+{
+	clear();
+	width = leafWidth;
+
+	const int n = (int)boxes.size();
+	if (n == 0)
+		return;
+
+	indices.resize(n);
+	std::vector<vec3f> centers(n);
+	for (int i = 0; i < n; ++i)
+	{
+		indices[i] = i;
+		centers[i] = boxes[i].center();
+	}
+
+	nodes.reserve(2 * n);
+	buildNode(boxes, centers, 0, n, 0);
+}
+
+double BVH::leafCost(int count) const
+{
+	return kIntersectCost * ((count + width - 1) / width);
+}
+
+// Build the subtree over indices[begin, end) and return its node index.
+// Splits are chosen by binning the primitive centers along each axis and
+// evaluating the surface area heuristic at every bin boundary.
+int BVH::buildNode(const std::vector<BoundingBox>& boxes,
+	const std::vector<vec3f>& centers, int begin, int end, int depth)
+{
+	const int index = (int)nodes.size();
+	nodes.push_back(Node());
+
+	BoundingBox bounds = boxes[indices[begin]];
+	vec3f cmin = centers[indices[begin]];
+	vec3f cmax = cmin;
+	for (int i = begin + 1; i < end; ++i)
+	{
+		bounds.merge(boxes[indices[i]]);
+		cmin = minimum(cmin, centers[indices[i]]);
+		cmax = maximum(cmax, centers[indices[i]]);
+	}
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		nodes[index].min[axis] = bounds.min[axis];
+		nodes[index].max[axis] = bounds.max[axis];
+	}
+
+	const int count = end - begin;
+	const double leaf_cost = leafCost(count);
+
+	int best_axis = -1;
+	int best_split = 0;
+	double best_cost = leaf_cost;
+
+	if (count > 1 && depth < kMaxDepth)
+	{
+		const double inv_area = 1.0 / std::max(bounds.area(), 1.0e-300);
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const double extent = cmax[axis] - cmin[axis];
+			if (extent <= 0.0)
+				continue;
+
+			Bin bins[kBins];
+			bool empty[kBins];
+			for (int b = 0; b < kBins; ++b)
+			{
+				bins[b].count = 0;
+				empty[b] = true;
+			}
+
+			const double scale = kBins / extent;
+			for (int i = begin; i < end; ++i)
+			{
+				int b = (int)((centers[indices[i]][axis] - cmin[axis]) * scale);
+				b = std::min(b, kBins - 1);
+				++bins[b].count;
+				growBounds(bins[b].bounds, empty[b], boxes[indices[i]]);
+			}
+
+			// sweep from the right to get the area and count of every
+			// right-hand side, then from the left to evaluate each split.
+			double right_area[kBins];
+			int right_count[kBins];
+			BoundingBox acc;
+			bool acc_empty = true;
+			int acc_count = 0;
+			for (int b = kBins - 1; b > 0; --b)
+			{
+				if (!empty[b])
+					growBounds(acc, acc_empty, bins[b].bounds);
+				acc_count += bins[b].count;
+				right_count[b] = acc_count;
+				right_area[b] = acc_empty ? 0.0 : acc.area();
+			}
+
+			acc_empty = true;
+			acc_count = 0;
+			for (int b = 0; b < kBins - 1; ++b)
+			{
+				if (!empty[b])
+					growBounds(acc, acc_empty, bins[b].bounds);
+				acc_count += bins[b].count;
+				if (acc_count == 0 || right_count[b + 1] == 0)
+					continue;
+
+				const double cost = kTraversalCost + inv_area
+					* (leafCost(acc_count) * acc.area()
+					+ leafCost(right_count[b + 1]) * right_area[b + 1]);
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b + 1;
+				}
+			}
+		}
+	}
+
+	int mid = begin;
+	if (best_axis >= 0)
+	{
+		const double scale = kBins / (cmax[best_axis] - cmin[best_axis]);
+		const double lo = cmin[best_axis];
+		const int axis = best_axis;
+		const int split = best_split;
+		mid = (int)(std::partition(indices.begin() + begin, indices.begin() + end,
+			[&](int i) {
+				const int b = std::min((int)((centers[i][axis] - lo) * scale), kBins - 1);
+				return b < split;
+			}) - indices.begin());
+	}
+	else if (count > std::max(kMaxLeafSize, width) && depth < kMaxDepth)
+	{
+		// Too many primitives to leave in one leaf, but the SAH found no
+		// useful split (e.g. coincident centers).  Halve the range.
+		mid = begin + count / 2;
+	}
+
+	if (mid == begin || mid == end)
+	{
+		nodes[index].offset = begin;
+		nodes[index].count = count;
+		return index;
+	}
+
+	buildNode(boxes, centers, begin, mid, depth + 1);
+	const int right = buildNode(boxes, centers, mid, end, depth + 1);
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+	return index;
+}
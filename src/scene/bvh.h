@@ -0,0 +1,435 @@
+//
+// bvh.h
+//
+// A bounding volume hierarchy over a set of axis-aligned boxes, built with
+// the surface area heuristic.  The hierarchy only knows about box indices;
+// whoever owns the primitives behind those indices passes a callback to
+// the traversal that intersects them when a leaf is reached.
+//
+// Camera rays can also go through in packets (see packet.h), which fetch
+// and test each node once for all of their rays.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <algorithm>
+
+#include "bbox.h"
+#include "packet.h"
+#include "ray.h"
+#include "../vecmath/simd.h"
+
+class BVH
+{
+public:
+	// Nodes are stored depth first, so the left child of an interior node
+	// always directly follows it and only the right child's index is kept.
+	struct Node
+	{
+		double min[3];
+		double max[3];
+		int offset;		// interior: index of the right child; leaf: first entry in indices
+		int count;		// number of primitives in a leaf, 0 for interior nodes
+
+		// slab test of r, starting at o, against the interval (tMin, tMax).
+		// The ray's sign bits pick the near and far planes of each slab.  On
+		// a hit, tNear is the entry distance clipped to tMin.
+		bool hit(const ray& r, const vec3f& o, double tMin, double tMax,
+			double& tNear) const
+		{
+			const vec3f& inv_d = r.getInverseDirection();
+			double lo = tMin;
+			double hi = tMax;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const int sign = r.getSign(axis);
+				const double t1 = ((sign ? max : min)[axis] - o[axis]) * inv_d[axis];
+				const double t2 = ((sign ? min : max)[axis] - o[axis]) * inv_d[axis];
+				// NaN (ray lying in a slab plane) fails both tests and
+				// leaves the interval untouched.
+				if (t1 > lo) lo = t1;
+				if (t2 < hi) hi = t2;
+				if (lo > hi) return false;
+			}
+			tNear = lo;
+			return true;
+		}
+	};
+
+	BVH() : width(1) {}
+
+	// Build the hierarchy over boxes.  Index i in the traversal callbacks
+	// refers to boxes[i].  Owners that test leafWidth primitives for the
+	// price of one pass it on, so that the SAH makes leaves of about that
+	// size.
+	void build(const std::vector<BoundingBox>& boxes, int leafWidth = 1);
+
+	void clear() { nodes.clear(); indices.clear(); }
+	bool empty() const { return nodes.empty(); }
+
+	// Visit the primitives whose boxes the ray passes through, nearest
+	// subtree first.  leaf(index, tMax) intersects one primitive and returns
+	// true on a hit, lowering tMax to the hit distance; subtrees that start
+	// beyond tMax are skipped.  Returns true if any leaf call did.
+	template <class LeafFn>
+	bool intersect(const ray& r, double& tMax, LeafFn& leaf) const;
+
+	// The same traversal, but leaf(first, count, tMax) is handed a whole
+	// leaf as the range [first, first + count) of order().  Owners that
+	// store their primitives in that order can test a leaf at once.
+	template <class LeafFn>
+	bool intersectRanges(const ray& r, double& tMax, LeafFn& leaf) const;
+
+	// The closest-hit search for a packet of rays, as intersectRanges()
+	// for each of them.  leaf(k, first, count, tMax[k]) intersects a leaf
+	// with ray k; tMax holds the interval ends of the rays, padded to
+	// RayPacket::kMaxRays.  Nodes are first tested against the whole
+	// packet by interval arithmetic, which rules a box out for every ray
+	// at once, then against each ray still in the search, SIMD_DOUBLE_LANES
+	// at a time.  Once a subtree is only reached by a few rays, or if the
+	// rays do not share their direction signs, the rest is left to
+	// intersectRanges() ray by ray.  Returns the rays with hits.
+	template <class LeafFn>
+	RayPacket::Mask intersectPacket(const RayPacket& p, double *tMax,
+		LeafFn& leaf) const;
+
+	// primitive indices in leaf order
+	const std::vector<int>& order() const { return indices; }
+
+	// call fn(first, count) with the range of order() of every leaf
+	template <class Fn>
+	void forEachLeaf(Fn fn) const
+	{
+		for (const Node& node : nodes)
+		{
+			if (node.count > 0)
+				fn(node.offset, node.count);
+		}
+	}
+
+	// Any-hit traversal for occlusion queries.  leaf(first, count) is
+	// handed a whole leaf as a range of order(), as for intersectRanges(),
+	// and returns true if any of it blocks the ray within tMax, which ends
+	// the search at once; the order in which leaves are visited is
+	// unspecified.
+	template <class LeafFn>
+	bool occludedRanges(const ray& r, double tMax, LeafFn& leaf) const;
+
+private:
+	// a packet whose rays in a subtree number at most this is split up
+	static const int kSingleRays = 2;
+
+	// intersectRanges() from node root down
+	template <class LeafFn>
+	bool intersectRangesFrom(int root, const ray& r, double& tMax,
+		LeafFn& leaf) const;
+
+	// the rays of mask that pass through node within their intervals
+	static RayPacket::Mask packetHits(const Node& node, const RayPacket& p,
+		const double *tMax, RayPacket::Mask mask);
+
+	int buildNode(const std::vector<BoundingBox>& boxes,
+		const std::vector<vec3f>& centers, int begin, int end, int depth);
+
+	// cost of intersecting count primitives of a leaf
+	double leafCost(int count) const;
+
+	std::vector<Node> nodes;
+	std::vector<int> indices;
+	int width;
+};
+
+template <class LeafFn>
+bool BVH::intersect(const ray& r, double& tMax, LeafFn& leaf) const
+{
+	auto eachPrimitive = [&](int first, int count, double& t) -> bool
+	{
+		bool hit = false;
+		for (int i = first; i < first + count; ++i)
+		{
+			if (leaf(indices[i], t))
+				hit = true;
+		}
+		return hit;
+	};
+	return intersectRanges(r, tMax, eachPrimitive);
+}
+
+template <class LeafFn>
+bool BVH::intersectRanges(const ray& r, double& tMax, LeafFn& leaf) const
+{
+	if (nodes.empty())
+		return false;
+	return intersectRangesFrom(0, r, tMax, leaf);
+}
+
+template <class LeafFn>
+bool BVH::intersectRangesFrom(int root, const ray& r, double& tMax,
+	LeafFn& leaf) const
+{
+	// deep enough for any tree buildNode() produces
+	static const int kStackSize = 64;
+
+	const vec3f o = r.getPosition();
+	const double tMin = r.getTMin();
+
+	struct Entry
+	{
+		int node;
+		double tNear;
+	} stack[kStackSize];
+	int sp = 0;
+
+	double tNear;
+	if (!nodes[root].hit(r, o, tMin, tMax, tNear))
+		return false;
+
+	bool have_one = false;
+	int current = root;
+	while (true)
+	{
+		const Node& node = nodes[current];
+		if (node.count > 0)
+		{
+			if (leaf(node.offset, node.count, tMax))
+				have_one = true;
+		}
+		else
+		{
+			int first = current + 1;
+			int second = node.offset;
+			double tFirst, tSecond;
+			const bool hit_first = nodes[first].hit(r, o, tMin, tMax, tFirst);
+			const bool hit_second = nodes[second].hit(r, o, tMin, tMax, tSecond);
+
+			if (hit_first && hit_second)
+			{
+				// descend into the nearer child, come back for the other
+				if (tSecond < tFirst)
+				{
+					std::swap(first, second);
+					std::swap(tFirst, tSecond);
+				}
+				stack[sp].node = second;
+				stack[sp].tNear = tSecond;
+				++sp;
+				current = first;
+				continue;
+			}
+			if (hit_first || hit_second)
+			{
+				current = hit_first ? first : second;
+				continue;
+			}
+		}
+
+		// pop the next subtree that still starts before the closest hit
+		do
+		{
+			if (sp == 0)
+				return have_one;
+			--sp;
+		} while (stack[sp].tNear > tMax);
+		current = stack[sp].node;
+	}
+}
+
+inline RayPacket::Mask BVH::packetHits(const Node& node, const RayPacket& p,
+	const double *tMax, RayPacket::Mask mask)
+{
+	const vec3f o = p.getOrigin();
+	const double tMin = p.get(0).getTMin();
+
+	// The distances to the near and far planes of each slab are the
+	// plane's offset from the shared origin times each ray's reciprocal
+	// direction, so over the packet they lie between the offset times the
+	// least and the greatest reciprocal.  If the bounds on the entry and
+	// exit distances that gives do not overlap, no ray hits the box.
+	double toNear[3], toFar[3];
+	double lo = tMin;
+	double hi = HUGE_VAL;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const int sign = p.getSign(axis);
+		toNear[axis] = (sign ? node.max : node.min)[axis] - o[axis];
+		toFar[axis] = (sign ? node.min : node.max)[axis] - o[axis];
+		const double t1 = toNear[axis] * (toNear[axis] >= 0.0
+			? p.getInverseMin(axis) : p.getInverseMax(axis));
+		const double t2 = toFar[axis] * (toFar[axis] >= 0.0
+			? p.getInverseMax(axis) : p.getInverseMin(axis));
+		// NaN (0 times an infinite reciprocal) says nothing
+		if (t1 > lo) lo = t1;
+		if (t2 < hi) hi = t2;
+	}
+	if (lo > hi)
+		return 0;
+
+	// the slab test of Node::hit(), ray by ray
+	RayPacket::Mask hits = 0;
+#if SIMD_DOUBLE_LANES > 1
+	using namespace simd;
+	const RayPacket::Mask lanes = (1ull << SIMD_DOUBLE_LANES) - 1;
+	for (int k = 0; k < p.size(); k += SIMD_DOUBLE_LANES)
+	{
+		if ((mask >> k & lanes) == 0)
+			continue;
+		vdouble tNear = vset(tMin);
+		vdouble tFar = vload(tMax + k);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const vdouble inv = vload(p.getInverse(axis) + k);
+			// with NaN the second operand comes out, as in Node::hit()
+			tNear = vmax(vmul(vset(toNear[axis]), inv), tNear);
+			tFar = vmin(vmul(vset(toFar[axis]), inv), tFar);
+		}
+		hits |= (RayPacket::Mask)vmask(vle(tNear, tFar)) << k;
+	}
+#else
+	for (int k = 0; k < p.size(); ++k)
+	{
+		double tNear;
+		if ((mask >> k & 1) && node.hit(p.get(k), o, tMin, tMax[k], tNear))
+			hits |= 1ull << k;
+	}
+#endif
+	return hits & mask;
+}
+
+template <class LeafFn>
+RayPacket::Mask BVH::intersectPacket(const RayPacket& p, double *tMax,
+	LeafFn& leaf) const
+{
+	static const int kStackSize = 64;
+
+	RayPacket::Mask found = 0;
+	if (nodes.empty())
+		return found;
+
+	// the search from node root down for the rays of mask, one by one
+	auto eachRay = [&](int root, RayPacket::Mask mask)
+	{
+		for (int k = 0; k < p.size(); ++k)
+		{
+			if ((mask >> k & 1) == 0)
+				continue;
+			auto leafOfRay = [&](int first, int count, double& t) -> bool
+			{
+				return leaf(k, first, count, t);
+			};
+			if (intersectRangesFrom(root, p.get(k), tMax[k], leafOfRay))
+				found |= 1ull << k;
+		}
+	};
+
+	if (!p.isCoherent())
+	{
+		eachRay(0, p.all());
+		return found;
+	}
+
+	// Children are visited nearer first as seen along the first ray; the
+	// others are near enough in direction to agree nearly always.
+	const vec3f d = p.get(0).getDirection();
+
+	struct Entry
+	{
+		int node;
+		RayPacket::Mask mask;
+	} stack[kStackSize];
+	int sp = 0;
+
+	int current = 0;
+	RayPacket::Mask mask = p.all();
+	while (true)
+	{
+		const Node& node = nodes[current];
+
+		// retested against the intervals as they are now, which may have
+		// shrunk since the node was pushed
+		mask = packetHits(node, p, tMax, mask);
+
+		// at most kSingleRays left?
+		RayPacket::Mask rest = mask;
+		for (int n = 0; n < kSingleRays && rest != 0; ++n)
+			rest &= rest - 1;
+
+		if (mask != 0 && rest == 0)
+		{
+			eachRay(current, mask);
+		}
+		else if (mask != 0 && node.count > 0)
+		{
+			for (int k = 0; k < p.size(); ++k)
+			{
+				if ((mask >> k & 1) && leaf(k, node.offset, node.count, tMax[k]))
+					found |= 1ull << k;
+			}
+		}
+		else if (mask != 0)
+		{
+			int first = current + 1;
+			int second = node.offset;
+			const Node& a = nodes[first];
+			const Node& b = nodes[second];
+			double ahead = 0.0;
+			for (int axis = 0; axis < 3; ++axis)
+				ahead += (b.min[axis] + b.max[axis] - a.min[axis] - a.max[axis]) * d[axis];
+			if (ahead < 0.0)
+				std::swap(first, second);
+
+			stack[sp].node = second;
+			stack[sp].mask = mask;
+			++sp;
+			current = first;
+			continue;
+		}
+
+		if (sp == 0)
+			return found;
+		--sp;
+		current = stack[sp].node;
+		mask = stack[sp].mask;
+	}
+}
+
+template <class LeafFn>
+bool BVH::occludedRanges(const ray& r, double tMax, LeafFn& leaf) const
+{
+	static const int kStackSize = 64;
+
+	if (nodes.empty())
+		return false;
+
+	const vec3f o = r.getPosition();
+	const double tMin = r.getTMin();
+
+	int stack[kStackSize];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	double tNear;
+	while (sp > 0)
+	{
+		const int current = stack[--sp];
+		const Node& node = nodes[current];
+		if (!node.hit(r, o, tMin, tMax, tNear))
+			continue;
+
+		if (node.count > 0)
+		{
+			if (leaf(node.offset, node.count))
+				return true;
+		}
+		else
+		{
+			// children are tested when popped, so no need to sort them
+			stack[sp++] = node.offset;
+			stack[sp++] = current + 1;
+		}
+	}
+	return false;
+}
+
+#endif // __BVH_H__
@@ -1,4 +1,5 @@
 #include "camera.h"
+#include "../vecmath/simd.h"
 
 #define PI 3.14159265359
 #define SHOW(x) (cerr << #x << " = " << (x) << "\n")
@@ -25,6 +26,44 @@ Camera::rayThrough(double x, double y, ray &r)
 	r = ray(eye, dir.normalize());
 }
 
+void
+Camera::raysThrough(const double *x, const double *y, int n, RayPacket &packet)
+// The directions are worked out SIMD_DOUBLE_LANES at a time, in the same
+// order of operations as rayThrough(), so they come out the same.
+{
+	double dir[3][RayPacket::kMaxRays];
+	int k = 0;
+#if SIMD_DOUBLE_LANES > 1
+	using namespace simd;
+	const vdouble half = vset(0.5);
+	for (; k + SIMD_DOUBLE_LANES <= n; k += SIMD_DOUBLE_LANES)
+	{
+		const vdouble px = vsub(vload(x + k), half);
+		const vdouble py = vsub(vload(y + k), half);
+		vdouble d[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			d[axis] = vadd(vadd(vset(look[axis]), vmul(px, vset(u[axis]))),
+				vmul(py, vset(v[axis])));
+		}
+		const vdouble length = vsqrt(vadd(vadd(vmul(d[0], d[0]), vmul(d[1], d[1])),
+			vmul(d[2], d[2])));
+		for (int axis = 0; axis < 3; ++axis)
+			vstore(dir[axis] + k, vdiv(d[axis], length));
+	}
+#endif
+	for (; k < n; ++k)
+	{
+		const vec3f d = (look + (x[k] - 0.5) * u + (y[k] - 0.5) * v).normalize();
+		for (int axis = 0; axis < 3; ++axis)
+			dir[axis][k] = d[axis];
+	}
+
+	packet.reset(eye);
+	for (k = 0; k < n; ++k)
+		packet.add(vec3f(dir[0][k], dir[1][k], dir[2][k]));
+}
+
 void
 Camera::setEye(const vec3f &eye)
 {
@@ -2,12 +2,16 @@
 #define CAMERA_H
 
 #include "ray.h"
+#include "packet.h"
 
 class Camera
 {
 public:
 	Camera();
 	void rayThrough(double x, double y, ray &r);
+	// rayThrough() for the n points (x[k], y[k]), at most
+	// RayPacket::kMaxRays, made into a packet
+	void raysThrough(const double *x, const double *y, int n, RayPacket &packet);
 	void setEye(const vec3f &eye);
 	void setLook(double, double, double, double);
 	void setLook(const vec3f &viewDir, const vec3f &upDir);
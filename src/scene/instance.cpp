@@ -0,0 +1,63 @@
+#include "instance.h"
+
+Prototype::~Prototype()
+{
+	for (auto *obj : objects)
+	{
+		delete obj;
+	}
+}
+
+void Prototype::build()
+{
+	vector<Geometry*> boundedobjects;
+	nonboundedobjects.clear();
+	has_transmissive = false;
+
+	for (auto *obj : objects)
+	{
+		if (obj->transmits())
+			has_transmissive = true;
+		if (obj->hasBoundingBoxCapability())
+		{
+			if (boundedobjects.empty())
+				bounds = obj->getBoundingBox();
+			else
+				bounds.merge(obj->getBoundingBox());
+
+			boundedobjects.push_back(obj);
+		}
+		else
+		{
+			nonboundedobjects.push_back(obj);
+		}
+	}
+
+	has_bounds = nonboundedobjects.empty() && !boundedobjects.empty();
+	primitives.build(boundedobjects);
+}
+
+// Same search as Scene::intersect(), over the objects of this definition.
+bool Prototype::intersect(const ray& r, isect& i) const
+{
+	isect cur;
+	bool have_one = false;
+	ray probe(r);
+
+	for (auto *obj : nonboundedobjects)
+	{
+		if (obj->intersect(probe, cur)) {
+			i = cur;
+			have_one = true;
+			probe.setTMax(cur.t);
+		}
+	}
+
+	if (primitives.intersect(probe, cur))
+	{
+		i = cur;
+		have_one = true;
+	}
+
+	return have_one;
+}
@@ -0,0 +1,92 @@
+//
+// instance.h
+//
+// Geometry that is defined once in the scene file and placed any number of
+// times.  A Prototype owns the objects of one definition together with a
+// hierarchy over them; every Instance only adds its own TransformNode, so
+// memory grows with the unique geometry rather than with the placements.
+//
+
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include <vector>
+
+#include "scene.h"
+
+class Prototype
+{
+public:
+	Prototype()
+		: transformRoot(), has_bounds(true), has_transmissive(false) {}
+	~Prototype();
+
+	void add(Geometry* obj)
+	{
+		obj->ComputeBoundingBox();
+		objects.push_back(obj);
+	}
+
+	// Build the hierarchy over the objects.  Call once the definition has
+	// been read completely.
+	void build();
+
+	// intersections performed in the prototype's own coordinate space
+	bool intersect(const ray& r, isect& i) const;
+
+	// a prototype is only bounded if every object in it is
+	bool hasBoundingBoxCapability() const { return has_bounds; }
+	const BoundingBox& getBoundingBox() const { return bounds; }
+
+	// does any object in it let light through?
+	bool transmits() const { return has_transmissive; }
+
+	// parent of the transforms of the objects inside the definition
+	TransformRoot transformRoot;
+
+private:
+	vector<Geometry*> objects;
+	vector<Geometry*> nonboundedobjects;
+	PrimitiveStore primitives;
+	BoundingBox bounds;
+	bool has_bounds;
+	bool has_transmissive;
+};
+
+// One placement of a Prototype.  The ray is brought into the instance's
+// space by Geometry::intersect() and then handed to the shared hierarchy.
+class Instance
+	: public Geometry
+{
+public:
+	Instance(Scene *scene, const Prototype *proto, TransformNode *transform)
+		: Geometry(scene), prototype(proto)
+	{
+		setTransform(transform);
+	}
+
+	virtual bool intersectLocal(const ray& r, isect& i) const
+	{
+		return prototype->intersect(r, i);
+	}
+
+	virtual bool hasBoundingBoxCapability() const
+	{
+		return prototype->hasBoundingBoxCapability();
+	}
+
+	virtual BoundingBox ComputeLocalBoundingBox()
+	{
+		return prototype->getBoundingBox();
+	}
+
+	virtual bool transmits() const
+	{
+		return prototype->transmits();
+	}
+
+private:
+	const Prototype *prototype;
+};
+
+#endif // __INSTANCE_H__
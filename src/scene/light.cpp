@@ -1,38 +1,110 @@
 #include <cmath>
 #include <cstdlib>
 #include <algorithm>
+#include <utility>
+#include <vector>
 
-#include "../ui/TraceUI.h"
-#include "../global.h"
 #include "light.h"
+#include "stats.h"
 
-double DirectionalLight::distanceAttenuation(const vec3f&) const
+namespace
+{
+
+	// The last opaque object found between a shading point and each light.
+	// Neighbouring points tend to be shadowed by the same object, so it is
+	// worth testing that one first.  Every render thread keeps its own,
+	// and the entries are only good for the scene they were found in.  It
+	// counts its lookups and hits until they are flushed to renderStats.
+	struct OccluderCache
+	{
+		unsigned scene;
+		std::vector<std::pair<const Light*, const Geometry*>> entries;
+		long long lookups;
+		long long hits;
+
+		const Geometry *&lookup(const Scene *s, const Light *light)
+		{
+			if (scene != s->getSerial())
+			{
+				scene = s->getSerial();
+				entries.clear();
+			}
+			for (auto& e : entries)
+			{
+				if (e.first == light)
+					return e.second;
+			}
+			entries.push_back(std::make_pair(light, (const Geometry*)NULL));
+			return entries.back().second;
+		}
+	};
+
+	thread_local OccluderCache occluderCache;
+
+}
+
+vec3f Light::shadowTransmittance(const ray& r, double tMax, const RenderSettings& s) const
+{
+	// where nothing lets light through, the first hit found is a shadow
+	const double threshold = s.intensityThreshold;
+	const bool opaque = scene->isOpaque();
+	if (!s.occluderCache)
+	{
+		if (opaque)
+			return scene->occluded(r, tMax) ? vec3f() : vec3f(1.0, 1.0, 1.0);
+		return scene->transmittance(r, tMax, threshold);
+	}
+
+	++occluderCache.lookups;
+	ray segment(r);
+	segment.setTMax(tMax);
+	const Geometry *&last = occluderCache.lookup(scene, this);
+	if (last && last->occludes(segment))
+	{
+		++occluderCache.hits;
+		return vec3f();
+	}
+
+	last = NULL;
+	if (opaque)
+		return scene->occluded(r, tMax, &last) ? vec3f() : vec3f(1.0, 1.0, 1.0);
+	return scene->transmittance(r, tMax, threshold, &last);
+}
+
+void Light::flushCacheStats()
+{
+	renderStats.occluder_lookups += occluderCache.lookups;
+	renderStats.occluder_hits += occluderCache.hits;
+	occluderCache.lookups = 0;
+	occluderCache.hits = 0;
+}
+
+double DirectionalLight::distanceAttenuation(const vec3f&, const RenderSettings&) const
 {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
 	return 1.0;
 }
 
 
-vec3f DirectionalLight::shadowAttenuation(const vec3f& P) const
+vec3f DirectionalLight::shadowAttenuation(const vec3f& P, const RenderSettings& s) const
+{
+	const ShadowRay sr = shadowRay(P);
+	return shadowTransmittance(sr.r, sr.tMax, s);
+}
+
+void DirectionalLight::shadowRays(const vec3f& P, SampleRng::Key,
+	bool, const RenderSettings&, std::vector<ShadowRay>& rays) const
+{
+	rays.push_back(shadowRay(P));
+}
+
+Light::ShadowRay DirectionalLight::shadowRay(const vec3f& P) const
 {
 	const vec3f &dir = getDirection(P);
-	vec3f result(1.0, 1.0, 1.0);
 	// push the point outwards a bit so that the ray won't hit itself
-	vec3f point = P + dir * RAY_EPSILON;
-	while (!result.iszero())
-	{
-		isect i;
-		ray shadow_ray(point, dir);
-		if (!scene->intersect(shadow_ray, i))
-		{
-			return result;
-		}
-
-		result = prod(result, i.getMaterial().kt);
-		// slightly push the point forward to prevent hitting itself
-		point = shadow_ray.at(i.t) + dir * RAY_EPSILON;
-	}
-	return result;
+	const vec3f point = P + dir * RAY_EPSILON;
+	const ShadowRay sr = { ray(point, dir), 1.0e308 };
+	return sr;
 }
 
 vec3f DirectionalLight::getColor(const vec3f&) const
@@ -54,16 +126,16 @@ PointLight::PointLight(Scene *scene, const vec3f& pos, const vec3f& color)
 	quadratic_attenuation_coeff(0.0)
 {}
 
-double PointLight::distanceAttenuation(const vec3f& P) const
+double PointLight::distanceAttenuation(const vec3f& P, const RenderSettings& s) const
 {
 	const double d2 = (P - position).length_squared();
 	const double d = sqrt(d2);
 	double divisor;
-	if (traceUI->IsOverideDistance())
+	if (s.overrideDistance)
 	{
-		divisor = traceUI->GetDistanceConstant();
-		divisor += traceUI->GetDistanceLinear() * d;
-		divisor += traceUI->GetDistanceQuadratic() * d2;
+		divisor = s.distanceConstant;
+		divisor += s.distanceLinear * d;
+		divisor += s.distanceQuadratic * d2;
 	}
 	else
 	{
@@ -86,58 +158,60 @@ vec3f PointLight::getDirection(const vec3f& P) const
 }
 
 
-vec3f PointLight::shadowAttenuation(const vec3f& P) const
+vec3f PointLight::shadowAttenuation(const vec3f& P, const RenderSettings& s) const
 {
-	if (traceUI->IsEnableSoftShadow())
+	const ShadowRay sr = shadowRay_(P, getDirection(P));
+	return shadowTransmittance(sr.r, sr.tMax, s);
+}
+
+vec3f PointLight::softShadowAttenuation(const vec3f& P, SampleRng::Key seed,
+	const RenderSettings& s) const
+{
+	const int num_rays = s.softShadowSamples;
+	vec3f result;
+	for (int i = 0; i < num_rays; ++i)
 	{
-		vec3f result(1.0, 1.0, 1.0);
-		const double extend = 0.2;
-		const unsigned kNumRays = 3;
-		vec3f new_pos;
-		for (unsigned i = 0; i < kNumRays; ++i)
-		{
-			new_pos[0] = position[0] + extend * ((double)i / kNumRays - 0.5);
-			for (unsigned j = 0; j < kNumRays; ++j)
-			{
-				new_pos[1] = position[1] + extend * ((double)j / kNumRays - 0.5);
-				for (unsigned k = 0; k < kNumRays; ++k)
-				{
-					new_pos[2] = position[2] + extend * ((double)k / kNumRays - 0.5);
-					result += shadowAttenuation_(P, (new_pos - P).normalize());
-				}
-			}
-		}
-		return result / (kNumRays * kNumRays * kNumRays);
+		const vec3f new_pos = samplePosition(seed, i, s);
+		const ShadowRay sr = shadowRay_(P, (new_pos - P).normalize());
+		result += shadowTransmittance(sr.r, sr.tMax, s);
 	}
-	else
+	return result / num_rays;
+}
+
+void PointLight::shadowRays(const vec3f& P, SampleRng::Key seed, bool soft,
+	const RenderSettings& s, std::vector<ShadowRay>& rays) const
+{
+	if (!soft)
+	{
+		rays.push_back(shadowRay_(P, getDirection(P)));
+		return;
+	}
+	for (int i = 0; i < s.softShadowSamples; ++i)
 	{
-		return shadowAttenuation_(P, getDirection(P));
+		const vec3f new_pos = samplePosition(seed, i, s);
+		rays.push_back(shadowRay_(P, (new_pos - P).normalize()));
 	}
 }
 
-vec3f PointLight::shadowAttenuation_(const vec3f &P, const vec3f &dir) const
+Light::ShadowRay PointLight::shadowRay_(const vec3f &P, const vec3f &dir) const
 {
-	// Shoot a shadow ray at the intersecion point towards this light source, in
-	// case any object is intersected, ignore this light
-	vec3f result(1.0, 1.0, 1.0);
+	// Shoot a shadow ray at the intersecion point towards this light source;
+	// whatever lies in between dims the light by its transmissive color.
 	// push the point outwards a bit so that the ray won't hit itself
-	vec3f point = P + dir * RAY_EPSILON;
-	while (!result.iszero())
-	{
-		isect i;
-		ray shadow_ray(point, dir);
-		const double light_t = (position - point).length();
-		if (!scene->intersect(shadow_ray, i) || i.t >= light_t)
-		{
-			// if no intersection or the object is behind the light
-			return result;
-		}
+	const vec3f point = P + dir * RAY_EPSILON;
+	// nothing past the light can cast a shadow
+	const ShadowRay sr = { ray(point, dir), (position - point).length() };
+	return sr;
+}
 
-		result = prod(result, i.getMaterial().kt);
-		// slightly push the point forward to prevent hitting itself
-		point = shadow_ray.at(i.t) + dir * RAY_EPSILON;
-	}
-	return result;
+vec3f PointLight::samplePosition(SampleRng::Key seed, int i,
+	const RenderSettings& s) const
+{
+	// the light is a cube this wide, sampled at points of the pattern
+	const double extend = 0.2;
+	double u[3];
+	Sampler::Get(s.sampler).Generate(seed, i, 3, u);
+	return position + extend * vec3f(u[0] - 0.5, u[1] - 0.5, u[2] - 0.5);
 }
 
 void PointLight::setDistanceAttenuation(const double constant,
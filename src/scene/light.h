@@ -1,21 +1,62 @@
 #ifndef __LIGHT_H__
 #define __LIGHT_H__
 
+#include <vector>
+
 #include "scene.h"
+#include "settings.h"
+#include "../sampleRng.h"
 
 class Light
 	: public SceneElement
 {
 public:
-	virtual vec3f shadowAttenuation(const vec3f& P) const = 0;
-	virtual double distanceAttenuation(const vec3f& P) const = 0;
+	virtual vec3f shadowAttenuation(const vec3f& P, const RenderSettings& s) const = 0;
+
+	// The same, averaged over the light's extent, for soft shadows; seed
+	// names the pattern of rays sent to it.  A light without one casts
+	// hard shadows either way.
+	virtual vec3f softShadowAttenuation(const vec3f& P, SampleRng::Key,
+		const RenderSettings& s) const
+	{
+		return shadowAttenuation(P, s);
+	}
+
+	// A shadow ray, and how far along it an object can stand in the way.
+	struct ShadowRay
+	{
+		ray r;
+		double tMax;
+	};
+
+	// The rays that softShadowAttenuation(), or shadowAttenuation() when
+	// soft is false, sends out from P, appended to rays.  The attenuation
+	// is the mean of their transmittance()s; this is for tracing the
+	// shadow rays of many points together.
+	virtual void shadowRays(const vec3f& P, SampleRng::Key seed, bool soft,
+		const RenderSettings& s, std::vector<ShadowRay>& rays) const = 0;
+	vec3f transmittance(const ShadowRay& sr, const RenderSettings& s) const
+	{
+		return shadowTransmittance(sr.r, sr.tMax, s);
+	}
+
+	virtual double distanceAttenuation(const vec3f& P, const RenderSettings& s) const = 0;
 	virtual vec3f getColor(const vec3f& P) const = 0;
 	virtual vec3f getDirection(const vec3f& P) const = 0;
 
+	// Add the calling thread's occluder cache lookups and hits so far into
+	// renderStats; render threads do it after each tile.
+	static void flushCacheStats();
+
 protected:
 	Light(Scene *scene, const vec3f& col)
 		: SceneElement(scene), color(col) {}
 
+	// How much of this light gets along r up to tMax.  With the occluder
+	// cache enabled, the object that last blocked this light on the
+	// calling thread is tried before the scene is searched.
+	vec3f shadowTransmittance(const ray& r, double tMax, const RenderSettings& s) const;
+
 	vec3f 		color;
 };
 
@@ -25,12 +66,16 @@ class DirectionalLight
 public:
 	DirectionalLight(Scene *scene, const vec3f& orien, const vec3f& color)
 		: Light(scene, color), orientation(orien) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
-	virtual double distanceAttenuation(const vec3f& P) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, const RenderSettings& s) const;
+	virtual void shadowRays(const vec3f& P, SampleRng::Key seed, bool soft,
+		const RenderSettings& s, std::vector<ShadowRay>& rays) const;
+	virtual double distanceAttenuation(const vec3f& P, const RenderSettings& s) const;
 	virtual vec3f getColor(const vec3f& P) const;
 	virtual vec3f getDirection(const vec3f& P) const;
 
 protected:
+	ShadowRay shadowRay(const vec3f& P) const;
+
 	vec3f 		orientation;
 };
 
@@ -40,15 +85,22 @@ class PointLight
 public:
 	PointLight(Scene *scene, const vec3f& pos, const vec3f& color);
 
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
-	virtual double distanceAttenuation(const vec3f& P) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, const RenderSettings& s) const;
+	virtual vec3f softShadowAttenuation(const vec3f& P, SampleRng::Key seed,
+		const RenderSettings& s) const;
+	virtual void shadowRays(const vec3f& P, SampleRng::Key seed, bool soft,
+		const RenderSettings& s, std::vector<ShadowRay>& rays) const;
+	virtual double distanceAttenuation(const vec3f& P, const RenderSettings& s) const;
 	virtual vec3f getColor(const vec3f& P) const;
 	virtual vec3f getDirection(const vec3f& P) const;
 	void setDistanceAttenuation(const double constant, const double linear,
 		const double quadratic);
 
 protected:
-	vec3f shadowAttenuation_(const vec3f &P, const vec3f &dir) const;
+	// the ray from P along dir, up to the light
+	ShadowRay shadowRay_(const vec3f &P, const vec3f &dir) const;
+	// point i of the soft shadow pattern named by seed
+	vec3f samplePosition(SampleRng::Key seed, int i, const RenderSettings& s) const;
 
 	vec3f position;
 	double constant_attenuation_coeff;
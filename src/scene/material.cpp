@@ -2,8 +2,7 @@
 #include "ray.h"
 #include "material.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
-#include "../global.h"
+#include "settings.h"
 
 namespace
 {
@@ -22,44 +21,77 @@ namespace
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-vec3f Material::shade(Scene *scene, const ray& r, const isect& i) const
+template <bool kShadows, bool kSoftShadows>
+vec3f Material::shadeWith(Scene *scene, const ray& r, const isect& i,
+	SampleRng::Key seed, const RenderSettings& s) const
 {
 	const vec3f &point = r.at(i.t);
 
-	vec3f result = ke;
-	const vec3f &ambient_i = GetAmibientLightsIntensity(scene, point);
-	result += prod(prod(ka, ambient_i), vec3f(1.0, 1.0, 1.0) - kt);
+	vec3f result = shadeUnlit(scene, r, i);
 
+	SampleRng::Key light_index = 0;
 	for (auto *l : scene->GetLights())
 	{
-		const double dot_ln = i.N.dot(l->getDirection(point));
-		if (dot_ln <= 0.0)
+		const SampleRng::Key light_seed = lightSeed(seed, light_index++);
+
+		if (!facesLight(r, i, l))
 		{
 			continue;
 		}
 
-		const vec3f &shadow_attenuation = traceUI->IsEnableShadow()
-			? l->shadowAttenuation(point) : vec3f(1.0, 1.0, 1.0);
+		const vec3f &shadow_attenuation = !kShadows ? vec3f(1.0, 1.0, 1.0)
+			: kSoftShadows ? l->softShadowAttenuation(point, light_seed, s)
+			: l->shadowAttenuation(point, s);
 		if (shadow_attenuation.iszero())
 		{
 			continue;
 		}
-		const vec3f &attenuation = shadow_attenuation
-			* l->distanceAttenuation(point);
-		const vec3f &light_i = l->getColor(point);
-		const vec3f diffuse = prod(kd * dot_ln, vec3f(1.0, 1.0, 1.0) - kt);
+		result += shadeLight(r, i, l, shadow_attenuation, s);
+	}
+
+	return result;
+}
+
+vec3f Material::shadeUnlit(Scene *scene, const ray& r, const isect& i) const
+{
+	vec3f result = ke;
+	const vec3f &ambient_i = GetAmibientLightsIntensity(scene, r.at(i.t));
+	result += prod(prod(ka, ambient_i), vec3f(1.0, 1.0, 1.0) - kt);
+	return result;
+}
 
-		const vec3f &reflection = (2.0 * dot_ln * i.N - l->getDirection(point))
-			.normalize();
-		const double dot_rv = std::max<double>(reflection.dot(-r.getDirection()),
-			0.0);
-		const double specular_coeff = pow(dot_rv, shininess * 128);
-		const vec3f specular = ks * specular_coeff;
+bool Material::facesLight(const ray& r, const isect& i, const Light *l)
+{
+	// written so that a point whose normal is undefined still counts
+	return !(i.N.dot(l->getDirection(r.at(i.t))) <= 0.0);
+}
 
-		const vec3f intensity_coeff = diffuse + specular;
+vec3f Material::shadeLight(const ray& r, const isect& i, const Light *l,
+	const vec3f& shadow_attenuation, const RenderSettings& s) const
+{
+	const vec3f &point = r.at(i.t);
+	const double dot_ln = i.N.dot(l->getDirection(point));
 
-		result += prod(prod(attenuation, light_i), intensity_coeff);
-	}
+	const vec3f &attenuation = shadow_attenuation
+		* l->distanceAttenuation(point, s);
+	const vec3f &light_i = l->getColor(point);
+	const vec3f diffuse = prod(kd * dot_ln, vec3f(1.0, 1.0, 1.0) - kt);
 
-	return result;
+	const vec3f &reflection = (2.0 * dot_ln * i.N - l->getDirection(point))
+		.normalize();
+	const double dot_rv = std::max<double>(reflection.dot(-r.getDirection()),
+		0.0);
+	const double specular_coeff = pow(dot_rv, shininess * 128);
+	const vec3f specular = ks * specular_coeff;
+
+	const vec3f intensity_coeff = diffuse + specular;
+
+	return prod(prod(attenuation, light_i), intensity_coeff);
 }
+
+template vec3f Material::shadeWith<false, false>(Scene *, const ray&, const isect&,
+	SampleRng::Key, const RenderSettings&) const;
+template vec3f Material::shadeWith<true, false>(Scene *, const ray&, const isect&,
+	SampleRng::Key, const RenderSettings&) const;
+template vec3f Material::shadeWith<true, true>(Scene *, const ray&, const isect&,
+	SampleRng::Key, const RenderSettings&) const;
@@ -8,10 +8,13 @@
 #define __MATERIAL_H__
 
 #include "../vecmath/vecmath.h"
+#include "../sampleRng.h"
 
 class Scene;
 class ray;
 class isect;
+class Light;
+struct RenderSettings;
 
 class Material
 {
@@ -33,7 +36,27 @@ public:
 	virtual ~Material()
 	{}
 
-	virtual vec3f shade(Scene *scene, const ray& r, const isect& i) const;
+	// The phong model at this point, with the shadow switches fixed at
+	// compile time for the tracer's kernels; seed names the soft shadow
+	// patterns used here.  Instantiated in material.cpp for every
+	// combination.
+	template <bool kShadows, bool kSoftShadows>
+	vec3f shadeWith(Scene *scene, const ray& r, const isect& i,
+		SampleRng::Key seed, const RenderSettings& s) const;
+
+	// The pieces of shadeWith(), for shading many points before any of
+	// their shadow rays are traced.  shadeUnlit() is the light owed to no light
+	// source, and shadeLight() what l adds to it when the fraction
+	// shadow_attenuation of its light reaches the point, for every l that
+	// the point faces.  The key of l's shadow pattern is lightSeed().
+	vec3f shadeUnlit(Scene *scene, const ray& r, const isect& i) const;
+	static bool facesLight(const ray& r, const isect& i, const Light *l);
+	vec3f shadeLight(const ray& r, const isect& i, const Light *l,
+		const vec3f& shadow_attenuation, const RenderSettings& s) const;
+	static SampleRng::Key lightSeed(SampleRng::Key seed, SampleRng::Key light_index)
+	{
+		return SampleRng::Derive(seed, light_index);
+	}
 
 	vec3f ke;                    // emissive
 	vec3f ka;                    // ambient
@@ -0,0 +1,94 @@
+//
+// packet.h
+//
+// A bundle of camera rays from one small block of pixels, traced through
+// the hierarchy together.  They share their origin, and neighbouring
+// pixels look in nearly the same direction, so they mostly pass through
+// the same boxes: a node is fetched once for the whole packet and tested
+// against all of its rays at once (see BVH::intersectPacket()).
+//
+// Besides the rays themselves, the packet keeps their reciprocal
+// directions as a structure of arrays, for testing SIMD_DOUBLE_LANES rays
+// at a time, and the range of each over the packet, for ruling out a box
+// for every ray with one interval test.
+//
+
+#ifndef __PACKET_H__
+#define __PACKET_H__
+
+#include <cmath>
+
+#include "ray.h"
+
+class RayPacket
+{
+public:
+	// enough for a block of 8 x 8 pixels
+	static const int kMaxRays = 64;
+
+	// bit k stands for ray k
+	typedef unsigned long long Mask;
+
+	RayPacket()
+		: count(0), coherent(true), inv() {}
+
+	// Start again with no rays, all to come from o.
+	void reset(const vec3f& o)
+	{
+		origin = o;
+		count = 0;
+		coherent = true;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			invMin[axis] = HUGE_VAL;
+			invMax[axis] = -HUGE_VAL;
+		}
+	}
+
+	// Append the ray from the origin along the unit vector d.
+	void add(const vec3f& d)
+	{
+		ray& r = rays[count];
+		r = ray(origin, d);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const double v = r.getInverseDirection()[axis];
+			inv[axis][count] = v;
+			if (v < invMin[axis]) invMin[axis] = v;
+			if (v > invMax[axis]) invMax[axis] = v;
+			coherent = coherent && r.getSign(axis) == rays[0].getSign(axis);
+		}
+		++count;
+	}
+
+	int size() const { return count; }
+	Mask all() const { return count == kMaxRays ? ~0ull : (1ull << count) - 1; }
+
+	// Ray k.  The searches clip its interval to the closest hit so far.
+	const ray& get(int k) const { return rays[k]; }
+	ray& get(int k) { return rays[k]; }
+
+	const vec3f& getOrigin() const { return origin; }
+
+	// Do all the directions have the same signs?  Then every box has the
+	// same near and far planes for all of the rays.
+	bool isCoherent() const { return coherent; }
+	int getSign(int axis) const { return rays[0].getSign(axis); }
+
+	// the reciprocal directions along axis, padded to kMaxRays, and the
+	// least and greatest of them
+	const double *getInverse(int axis) const { return inv[axis]; }
+	double getInverseMin(int axis) const { return invMin[axis]; }
+	double getInverseMax(int axis) const { return invMax[axis]; }
+
+private:
+	vec3f origin;
+	int count;
+	bool coherent;
+	ray rays[kMaxRays];
+	double inv[3][kMaxRays];
+	double invMin[3];
+	double invMax[3];
+};
+
+#endif // __PACKET_H__
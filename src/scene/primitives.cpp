@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cmath>
+
+#include "primitives.h"
+#include "scene.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+
+namespace
+{
+
+	// Geometry::intersect() for an object whose class is known
+	template <class T>
+	inline bool intersectAs(const T *obj, const ray& r, isect& i)
+	{
+		return obj->intersectThrough(r, i, [obj](const ray& localRay, isect& hit) {
+			return obj->T::intersectLocal(localRay, hit);
+		});
+	}
+
+	template <class T>
+	void append(std::vector<const T*>& list, const T *obj, int& slot)
+	{
+		slot = (int)list.size();
+		list.push_back(obj);
+	}
+
+	PrimitiveStore::Type typeOf(const Geometry *obj)
+	{
+		if (const Sphere *s = dynamic_cast<const Sphere*>(obj))
+		{
+			WorldSphere ws;
+			return WorldSphere::match(s, ws)
+				? PrimitiveStore::WORLD_SPHERE : PrimitiveStore::SPHERE;
+		}
+		if (const Box *b = dynamic_cast<const Box*>(obj))
+		{
+			WorldBox wb;
+			return WorldBox::match(b, wb)
+				? PrimitiveStore::WORLD_BOX : PrimitiveStore::BOX;
+		}
+		if (const Square *q = dynamic_cast<const Square*>(obj))
+		{
+			WorldSquare wq;
+			return WorldSquare::match(q, wq)
+				? PrimitiveStore::WORLD_SQUARE : PrimitiveStore::SQUARE;
+		}
+		if (dynamic_cast<const Cylinder*>(obj))
+			return PrimitiveStore::CYLINDER;
+		if (dynamic_cast<const Cone*>(obj))
+			return PrimitiveStore::CONE;
+		if (dynamic_cast<const Trimesh*>(obj))
+			return PrimitiveStore::TRIMESH;
+		return PrimitiveStore::OTHER;
+	}
+
+}
+
+void PrimitiveStore::clear()
+{
+	entries.clear();
+	objects.clear();
+	spheres.clear();
+	boxes.clear();
+	squares.clear();
+	cylinders.clear();
+	cones.clear();
+	meshes.clear();
+	others.clear();
+	worldSpheres.clear();
+	worldBoxes.clear();
+	worldSquares.clear();
+	sphereBatch.clear();
+	cylinderBatch.clear();
+	coneBatch.clear();
+	bvh.clear();
+}
+
+void PrimitiveStore::build(const std::vector<Geometry*>& objs)
+{
+	clear();
+
+	std::vector<BoundingBox> bounds;
+	std::vector<int> types;
+	bounds.reserve(objs.size());
+	types.reserve(objs.size());
+	for (auto *obj : objs)
+	{
+		bounds.push_back(obj->getBoundingBox());
+		types.push_back(typeOf(obj));
+	}
+	bvh.build(bounds);
+
+	// entries follow the leaf order of the hierarchy, with each leaf sorted
+	// by type so that its spheres, cylinders and cones form runs
+	std::vector<int> order = bvh.order();
+	bvh.forEachLeaf([&](int first, int count) {
+		std::stable_sort(order.begin() + first, order.begin() + first + count,
+			[&](int a, int b) { return types[a] < types[b]; });
+	});
+
+	entries.resize(order.size());
+	objects.resize(order.size());
+	for (size_t k = 0; k < order.size(); ++k)
+	{
+		Geometry *obj = objs[order[k]];
+		Entry& e = entries[k];
+		objects[k] = obj;
+		e.type = (unsigned char)types[order[k]];
+
+		switch (e.type)
+		{
+		case SPHERE:
+			append(spheres, static_cast<const Sphere*>(obj), e.slot);
+			sphereBatch.add(obj, obj->ComputeLocalBoundingBox());
+			break;
+		case BOX:
+			append(boxes, static_cast<const Box*>(obj), e.slot);
+			break;
+		case SQUARE:
+			append(squares, static_cast<const Square*>(obj), e.slot);
+			break;
+		case CYLINDER:
+			append(cylinders, static_cast<const Cylinder*>(obj), e.slot);
+			cylinderBatch.add(obj, obj->ComputeLocalBoundingBox());
+			break;
+		case CONE:
+			append(cones, static_cast<const Cone*>(obj), e.slot);
+			coneBatch.add(obj, obj->ComputeLocalBoundingBox());
+			break;
+		case TRIMESH:
+			append(meshes, static_cast<const Trimesh*>(obj), e.slot);
+			break;
+		case WORLD_SPHERE:
+			e.slot = (int)worldSpheres.size();
+			worldSpheres.push_back(WorldSphere());
+			WorldSphere::match(static_cast<const Sphere*>(obj), worldSpheres.back());
+			break;
+		case WORLD_BOX:
+			e.slot = (int)worldBoxes.size();
+			worldBoxes.push_back(WorldBox());
+			WorldBox::match(static_cast<const Box*>(obj), worldBoxes.back());
+			break;
+		case WORLD_SQUARE:
+			e.slot = (int)worldSquares.size();
+			worldSquares.push_back(WorldSquare());
+			WorldSquare::match(static_cast<const Square*>(obj), worldSquares.back());
+			break;
+		default:
+			append(others, static_cast<const Geometry*>(obj), e.slot);
+			break;
+		}
+	}
+}
+
+bool PrimitiveStore::intersect(int k, const ray& r, isect& i) const
+{
+	const Entry& e = entries[k];
+	switch (e.type)
+	{
+	case SPHERE:
+		return intersectAs(spheres[e.slot], r, i);
+	case BOX:
+		return intersectAs(boxes[e.slot], r, i);
+	case SQUARE:
+		return intersectAs(squares[e.slot], r, i);
+	case CYLINDER:
+		return intersectAs(cylinders[e.slot], r, i);
+	case CONE:
+		return intersectAs(cones[e.slot], r, i);
+	case TRIMESH:
+		return meshes[e.slot]->Trimesh::intersect(r, i);
+	case WORLD_SPHERE:
+		return worldSpheres[e.slot].intersect(r, i);
+	case WORLD_BOX:
+		return worldBoxes[e.slot].intersect(r, i);
+	case WORLD_SQUARE:
+		return worldSquares[e.slot].intersect(r, i);
+	default:
+		return others[e.slot]->intersect(r, i);
+	}
+}
+
+bool PrimitiveStore::occludes(int k, const ray& r) const
+{
+	isect i;
+	Material m;
+	if (!intersect(k, r, i))
+		return false;
+	i.resolveMaterial(m);
+	return i.getMaterial().kt.iszero();
+}
+
+// Same search as Scene::intersect(): the ray is clipped to the closest hit
+// so far.
+bool PrimitiveStore::intersect(const ray& r, isect& i) const
+{
+	isect cur;
+	ray probe(r);
+	double tMax = r.getTMax();
+
+	auto intersectLeaf = [&](int first, int count, double& t) -> bool
+	{
+		bool have_one = false;
+		auto intersectEntry = [&](int k) -> bool
+		{
+			if (intersect(k, probe, cur)) {
+				i = cur;
+				t = cur.t;
+				probe.setTMax(t);
+				have_one = true;
+			}
+			return false;
+		};
+		visitLeaf(probe, first, count, intersectEntry);
+		return have_one;
+	};
+	return bvh.intersectRanges(r, tMax, intersectLeaf);
+}
+
+RayPacket::Mask PrimitiveStore::intersectPacket(RayPacket& p, isect *hits) const
+{
+	isect cur;
+	// the lanes past the packet's rays are loaded too; they hit nothing
+	double tMax[RayPacket::kMaxRays];
+	for (int k = 0; k < RayPacket::kMaxRays; ++k)
+		tMax[k] = k < p.size() ? p.get(k).getTMax() : -HUGE_VAL;
+
+	auto intersectLeaf = [&](int k, int first, int count, double& t) -> bool
+	{
+		ray& probe = p.get(k);
+		bool have_one = false;
+		auto intersectEntry = [&](int e) -> bool
+		{
+			if (intersect(e, probe, cur)) {
+				hits[k] = cur;
+				t = cur.t;
+				probe.setTMax(t);
+				have_one = true;
+			}
+			return false;
+		};
+		visitLeaf(probe, first, count, intersectEntry);
+		return have_one;
+	};
+	return bvh.intersectPacket(p, tMax, intersectLeaf);
+}
@@ -0,0 +1,164 @@
+//
+// primitives.h
+//
+// The bounded objects of a scene or definition, sorted by concrete class
+// into one array per type.  Testing an object switches on a small type tag
+// and calls that class's intersectLocal() directly, so the search makes no
+// virtual calls for the built-in primitives; anything else still goes
+// through Geometry::intersect().  The store owns the hierarchy over the
+// objects and keeps its entries in the hierarchy's leaf order, so that a
+// leaf is a run of consecutive entries, sorted by type within the leaf.
+// Runs of spheres, cylinders and cones are pre-tested together by a
+// QuadricBatch before any of them is intersected exactly, and spheres,
+// boxes and squares whose transforms allow it are intersected in world
+// space (see worldshapes.h).
+//
+
+#ifndef __PRIMITIVES_H__
+#define __PRIMITIVES_H__
+
+#include <vector>
+
+#include "bvh.h"
+#include "quadrics.h"
+#include "worldshapes.h"
+
+class Geometry;
+class isect;
+class Sphere;
+class Box;
+class Square;
+class Cylinder;
+class Cone;
+class Trimesh;
+
+class PrimitiveStore
+{
+public:
+	enum Type { SPHERE, BOX, SQUARE, CYLINDER, CONE, TRIMESH, OTHER,
+		WORLD_SPHERE, WORLD_BOX, WORLD_SQUARE };
+
+	PrimitiveStore()
+		: sphereBatch(QuadricBatch::SPHERE),
+		cylinderBatch(QuadricBatch::CYLINDER),
+		coneBatch(QuadricBatch::BOUNDS) {}
+
+	// Sort objects into the store and build the hierarchy over their
+	// world-space boxes.  The store does not own them.
+	void build(const std::vector<Geometry*>& objects);
+	void clear();
+
+	int size() const { return (int)entries.size(); }
+	const Geometry *object(int k) const { return objects[k]; }
+
+	// intersect entry k
+	bool intersect(int k, const ray& r, isect& i) const;
+
+	// does entry k stop all light within r's interval?
+	bool occludes(int k, const ray& r) const;
+
+	// closest hit among all entries within r's interval
+	bool intersect(const ray& r, isect& i) const;
+
+	// The same for every ray of p, with the hit of ray k put in hits[k].
+	// Each ray's interval is clipped to its closest hit.  Returns the
+	// rays with hits.
+	RayPacket::Mask intersectPacket(RayPacket& p, isect *hits) const;
+
+	// Call visit(k) for the entries whose boxes r passes through, in no
+	// particular order, until one returns true.
+	template <class VisitFn>
+	bool any(const ray& r, VisitFn& visit) const;
+
+private:
+	struct Entry
+	{
+		unsigned char type;
+		int slot;		// index into the array of that type
+	};
+
+	// the pre-test for entries of type, if there is one
+	const QuadricBatch *batchFor(int type) const
+	{
+		switch (type)
+		{
+		case SPHERE: return &sphereBatch;
+		case CYLINDER: return &cylinderBatch;
+		case CONE: return &coneBatch;
+		default: return NULL;
+		}
+	}
+
+	// Call visit(k) for the entries [first, first + count) that r may hit,
+	// until one returns true.
+	template <class VisitFn>
+	bool visitLeaf(const ray& r, int first, int count, VisitFn& visit) const;
+
+	std::vector<Entry> entries;
+	std::vector<const Geometry*> objects;
+
+	std::vector<const Sphere*> spheres;
+	std::vector<const Box*> boxes;
+	std::vector<const Square*> squares;
+	std::vector<const Cylinder*> cylinders;
+	std::vector<const Cone*> cones;
+	std::vector<const Trimesh*> meshes;
+	std::vector<const Geometry*> others;
+	std::vector<WorldSphere> worldSpheres;
+	std::vector<WorldBox> worldBoxes;
+	std::vector<WorldSquare> worldSquares;
+
+	// parallel to spheres, cylinders and cones
+	QuadricBatch sphereBatch;
+	QuadricBatch cylinderBatch;
+	QuadricBatch coneBatch;
+
+	BVH bvh;
+};
+
+template <class VisitFn>
+bool PrimitiveStore::visitLeaf(const ray& r, int first, int count,
+	VisitFn& visit) const
+{
+	const int end = first + count;
+	for (int k = first; k < end; )
+	{
+		const QuadricBatch *batch = batchFor(entries[k].type);
+		if (batch == NULL)
+		{
+			if (visit(k))
+				return true;
+			++k;
+			continue;
+		}
+
+		// same-type entries have consecutive slots
+		int run = 1;
+		while (k + run < end && run < QuadricBatch::kMaxRun
+			&& entries[k + run].type == entries[k].type)
+			++run;
+
+		// a lone object is cheaper to test exactly
+		unsigned hits = run > 1
+			? batch->candidates(r, entries[k].slot, run) : 1u;
+		for (int j = 0; hits != 0; ++j, hits >>= 1)
+		{
+			if ((hits & 1) && visit(k + j))
+				return true;
+		}
+		k += run;
+	}
+	return false;
+}
+
+template <class VisitFn>
+bool PrimitiveStore::any(const ray& r, VisitFn& visit) const
+{
+	auto eachEntry = [&](int first, int count) -> bool
+	{
+		return visitLeaf(r, first, count, visit);
+	};
+	return bvh.occludedRanges(r, r.getTMax(), eachEntry);
+}
+
+#endif // __PRIMITIVES_H__
@@ -0,0 +1,190 @@
+#include <cmath>
+
+#include "quadrics.h"
+#include "scene.h"
+#include "../vecmath/simd.h"
+
+#if SIMD_DOUBLE_LANES > 1
+using namespace simd;
+#endif
+
+namespace
+{
+
+	// How far the pre-test widens every bound, so that rounding in it can
+	// never rule out a hit the exact test would find.
+	const double kSlack = 1.0e-9;
+
+#if SIMD_DOUBLE_LANES > 1
+
+	// Clip (tNear, tFar) to where o + t v lies between lo and hi.
+	inline void slab(vdouble o, vdouble v, vdouble lo, vdouble hi,
+		vdouble& tNear, vdouble& tFar)
+	{
+		const vdouble inf = vset(HUGE_VAL);
+		const vdouble ninf = vset(-HUGE_VAL);
+		const vdouble inv = vdiv(vset(1.0), v);
+		const vdouble t0 = vmul(vsub(lo, o), inv);
+		const vdouble t1 = vmul(vsub(hi, o), inv);
+		vdouble n = vmin(t0, t1);
+		vdouble f = vmax(t0, t1);
+
+		// a ray parallel to the slab is either always or never inside it
+		const vdouble parallel = veq(v, vset(0.0));
+		const vdouble inside = vand(vge(o, lo), vle(o, hi));
+		n = vselect(parallel, vselect(inside, ninf, inf), n);
+		f = vselect(parallel, vselect(inside, inf, ninf), f);
+
+		tNear = vmax(tNear, n);
+		tFar = vmin(tFar, f);
+	}
+
+	// Clip (tNear, tFar) to where a t^2 + 2 b t + c <= 0, for a >= 0.
+	inline void quadratic(vdouble a, vdouble b, vdouble c,
+		vdouble& tNear, vdouble& tFar)
+	{
+		const vdouble zero = vset(0.0);
+		const vdouble inf = vset(HUGE_VAL);
+		const vdouble ninf = vset(-HUGE_VAL);
+
+		const vdouble ac = vmul(a, c);
+		const vdouble disc = vsub(vmul(b, b), ac);
+		const vdouble tolerance = vmul(vset(kSlack),
+			vadd(vmul(b, b), vmax(ac, vsub(zero, ac))));
+		const vdouble real = vge(disc, vsub(zero, tolerance));
+
+		const vdouble root = vsqrt(vmax(disc, zero));
+		vdouble n = vdiv(vsub(vsub(zero, b), root), a);
+		vdouble f = vdiv(vsub(root, b), a);
+		n = vselect(real, n, inf);
+		f = vselect(real, f, ninf);
+
+		// a = 0: the ray runs along the axis, and b = 0, so it is either
+		// always or never inside
+		const vdouble flat = veq(a, zero);
+		const vdouble inside = vle(c, vset(kSlack));
+		n = vselect(flat, vselect(inside, ninf, inf), n);
+		f = vselect(flat, vselect(inside, inf, ninf), f);
+
+		tNear = vmax(tNear, n);
+		tFar = vmin(tFar, f);
+	}
+
+#endif
+
+}
+
+void QuadricBatch::clear()
+{
+	for (int e = 0; e < 12; ++e)
+		m[e].clear();
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		lo[axis].clear();
+		hi[axis].clear();
+	}
+	count = 0;
+}
+
+void QuadricBatch::add(Geometry *obj, const BoundingBox& localBounds)
+{
+	// columns of the inverse transform, from the images of the origin and
+	// the unit vectors
+	const Transform& xform = obj->getTransform();
+	const vec3f origin = xform.globalToLocalCoords(vec3f(0.0, 0.0, 0.0));
+	const vec3f cols[3] = {
+		xform.globalToLocalVector(vec3f(1.0, 0.0, 0.0)),
+		xform.globalToLocalVector(vec3f(0.0, 1.0, 0.0)),
+		xform.globalToLocalVector(vec3f(0.0, 0.0, 1.0))
+	};
+
+	// as in TriangleSet, the new object takes the first padding slot and
+	// one more padding object goes on the end
+	for (int row = 0; row < 3; ++row)
+	{
+		for (int col = 0; col < 4; ++col)
+		{
+			std::vector<double>& e = m[row * 4 + col];
+			e.resize(count + SIMD_DOUBLE_LANES, 0.0);
+			e[count] = col < 3 ? cols[col][row] : origin[row];
+		}
+	}
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const double slack = kSlack * (1.0 + localBounds.max[axis] - localBounds.min[axis]);
+		lo[axis].resize(count + SIMD_DOUBLE_LANES, 0.0);
+		hi[axis].resize(count + SIMD_DOUBLE_LANES, 0.0);
+		lo[axis][count] = localBounds.min[axis] - slack;
+		hi[axis][count] = localBounds.max[axis] + slack;
+	}
+	++count;
+}
+
+unsigned QuadricBatch::candidates(const ray& r, int first, int num) const
+{
+	const unsigned all = num >= kMaxRun ? ~0u : (1u << num) - 1;
+
+#if SIMD_DOUBLE_LANES > 1
+	const vec3f p = r.getPosition();
+	const vec3f d = r.getDirection();
+	const vdouble px = vset(p[0]), py = vset(p[1]), pz = vset(p[2]);
+	const vdouble dx = vset(d[0]), dy = vset(d[1]), dz = vset(d[2]);
+	const vdouble tMin = vset(r.getTMin() - kSlack);
+	const vdouble tMax = vset(r.getTMax() * (1.0 + kSlack) + kSlack);
+	const vdouble one = vset(1.0);
+
+	unsigned result = 0;
+	for (int j = 0; j < num; j += SIMD_DOUBLE_LANES)
+	{
+		const int k = first + j;
+
+		// The ray in the objects' spaces.  The direction is left as it
+		// comes out of the transform, so that t is still the distance
+		// along r.
+		vdouble o[3], v[3];
+		for (int row = 0; row < 3; ++row)
+		{
+			const vdouble m0 = vload(&m[row * 4][k]);
+			const vdouble m1 = vload(&m[row * 4 + 1][k]);
+			const vdouble m2 = vload(&m[row * 4 + 2][k]);
+			const vdouble m3 = vload(&m[row * 4 + 3][k]);
+			o[row] = vadd(vadd(vmul(m0, px), vmul(m1, py)), vadd(vmul(m2, pz), m3));
+			v[row] = vadd(vadd(vmul(m0, dx), vmul(m1, dy)), vmul(m2, dz));
+		}
+
+		vdouble tNear = tMin;
+		vdouble tFar = tMax;
+		switch (shape)
+		{
+		case SPHERE:
+			quadratic(vadd(vadd(vmul(v[0], v[0]), vmul(v[1], v[1])), vmul(v[2], v[2])),
+				vadd(vadd(vmul(o[0], v[0]), vmul(o[1], v[1])), vmul(o[2], v[2])),
+				vsub(vadd(vadd(vmul(o[0], o[0]), vmul(o[1], o[1])), vmul(o[2], o[2])), one),
+				tNear, tFar);
+			break;
+
+		case CYLINDER:
+			quadratic(vadd(vmul(v[0], v[0]), vmul(v[1], v[1])),
+				vadd(vmul(o[0], v[0]), vmul(o[1], v[1])),
+				vsub(vadd(vmul(o[0], o[0]), vmul(o[1], o[1])), one),
+				tNear, tFar);
+			slab(o[2], v[2], vset(-kSlack), vset(1.0 + kSlack), tNear, tFar);
+			break;
+
+		default:
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				slab(o[axis], v[axis], vload(&lo[axis][k]), vload(&hi[axis][k]),
+					tNear, tFar);
+			}
+			break;
+		}
+
+		result |= (unsigned)vmask(vle(tNear, tFar)) << j;
+	}
+	return result & all;
+#else
+	// no vector unit: leave everything to the exact tests
+	return all;
+#endif
+}
@@ -0,0 +1,59 @@
+//
+// quadrics.h
+//
+// A pre-test of one ray against a run of spheres, cylinders or cones at
+// once.  The inverse transforms of the objects are kept as a structure of
+// arrays, and SIMD_DOUBLE_LANES objects at a time are brought into their
+// own spaces and tested in double precision.  The test is conservative: it
+// only rules out objects that the ray cannot hit, and the exact hit is
+// still found by the object's intersectLocal().  Most objects in a leaf
+// are missed, so that is where it saves time.
+//
+
+#ifndef __QUADRICS_H__
+#define __QUADRICS_H__
+
+#include <vector>
+
+#include "bbox.h"
+#include "ray.h"
+
+class Geometry;
+
+class QuadricBatch
+{
+public:
+	enum Shape
+	{
+		SPHERE,		// the unit sphere itself
+		CYLINDER,	// the unit cylinder between z = 0 and z = 1
+		BOUNDS		// anything else, by its local bounding box
+	};
+
+	// the longest run candidates() takes
+	static const int kMaxRun = 32;
+
+	explicit QuadricBatch(Shape s)
+		: shape(s), count(0) {}
+
+	void clear();
+
+	// Append obj, whose own space is bounded by localBounds.
+	void add(Geometry *obj, const BoundingBox& localBounds);
+
+	// Bit j of the result is set if r may hit object first + j within its
+	// interval.  count is at most kMaxRun.
+	unsigned candidates(const ray& r, int first, int count) const;
+
+private:
+	Shape shape;
+
+	// inverse transform of each object, row major: m[row * 4 + col][object]
+	std::vector<double> m[12];
+	// local bounds of each object, for BOUNDS
+	std::vector<double> lo[3];
+	std::vector<double> hi[3];
+	int count;
+};
+
+#endif // __QUADRICS_H__
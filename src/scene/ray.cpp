@@ -7,3 +7,10 @@ isect::getMaterial() const
 {
     return material ? *material : obj->getMaterial();
 }
+
+void
+isect::resolveMaterial( Material& storage )
+{
+    if( obj->interpolateMaterial( *this, storage ) )
+        material = &storage;
+}
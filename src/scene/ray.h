@@ -14,17 +14,35 @@ class SceneObject;
 
 // A ray has a position where the ray starts, and a direction (which should
 // always be normalized!)
+//
+// Only hits with tMin < t < tMax count; every intersectLocal() must reject
+// anything outside that interval, so that the search can shrink tMax to
+// the closest hit so far and let farther candidates fail early.  The
+// reciprocal of the direction and its sign bits are kept for slab tests.
 
 class ray {
 public:
-	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ) {}
+	// a placeholder, to be assigned a real ray
+	ray()
+		: p(), d(), inv_d(), t_min( 0.0 ), t_max( 1.0e308 )
+	{ sign[0] = sign[1] = sign[2] = 0; }
+	ray( const vec3f& pp, const vec3f& dd,
+		double tmin = 0.0, double tmax = 1.0e308 )
+		: p( pp ), d( dd ), t_min( tmin ), t_max( tmax )
+	{ setInverse(); }
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), inv_d( other.inv_d ),
+		t_min( other.t_min ), t_max( other.t_max )
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{
+		p = other.p; d = other.d; inv_d = other.inv_d;
+		sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+		t_min = other.t_min; t_max = other.t_max;
+		return *this;
+	}
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
@@ -32,59 +50,62 @@ public:
 	vec3f getPosition() const { return p; }
 	vec3f getDirection() const { return d; }
 
+	// 1/d per component, infinite along axes the ray is parallel to
+	const vec3f& getInverseDirection() const { return inv_d; }
+	// 1 where the direction component is negative, else 0
+	int getSign( int axis ) const { return sign[axis]; }
+
+	double getTMin() const { return t_min; }
+	double getTMax() const { return t_max; }
+	void setTMax( double t ) { t_max = t; }
+
+	// is t inside the interval of this ray?
+	bool inRange( double t ) const { return t > t_min && t < t_max; }
+
 protected:
+	void setInverse()
+	{
+		inv_d = vec3f( 1.0 / d[0], 1.0 / d[1], 1.0 / d[2] );
+		sign[0] = inv_d[0] < 0.0;
+		sign[1] = inv_d[1] < 0.0;
+		sign[2] = inv_d[2] < 0.0;
+	}
+
 	vec3f p;
 	vec3f d;
+	vec3f inv_d;
+	int sign[3];
+	double t_min;
+	double t_max;
 };
 
-// The description of an intersection point.
+// The description of an intersection point.  It owns nothing, so the
+// searches can copy it freely; a material that varies over the surface is
+// only worked out, by resolveMaterial(), for the hit that is kept.
 
 class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N(), bary(), face( -1 ), material( NULL ) {}
 
-    ~isect()
-    {
-        delete material;
-    }
-    
     void setObject( SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
-    void setMaterial( Material *m ) { delete material; material = m; }
-        
-    isect& operator =( const isect& other )
-    {
-        if( this != &other )
-        {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                material = 0;
-            }
-        }
-        return *this;
-    }
+
+    // If obj's material varies over its surface, work out the one at this
+    // point into storage, which must outlive any use of getMaterial().
+    void resolveMaterial( Material& storage );
 
 public:
     const SceneObject 	*obj;
     double t;
     vec3f N;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    vec3f bary;                 // barycentric coordinates within face
+    int face;                   // the triangle hit, for meshes
+    const Material *material;   // set by resolveMaterial(), if this
+                                // intersection has its own material (as
+                                // opposed to the one of its object)
 
     const Material &getMaterial() const;
     // Other info here.
@@ -2,8 +2,7 @@
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
-extern TraceUI* traceUI;
+#include "instance.h"
 
 void BoundingBox::operator=(const BoundingBox& target)
 {
@@ -34,10 +33,10 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
 	vec3f R0 = r.getPosition();
 	vec3f Rd = r.getDirection();
+	const vec3f& inv_d = r.getInverseDirection();
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
 
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
@@ -47,18 +46,10 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 		if (vd == 0.0)
 			continue;
 
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
-
-		// two slab intersections
-		double t1 = v1 / vd;
-		double t2 = v2 / vd;
-
-		if (t1 > t2) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
+		// two slab intersections, near one first
+		const int sign = r.getSign(currentaxis);
+		double t1 = ((sign ? max : min)[currentaxis] - R0[currentaxis]) * inv_d[currentaxis];
+		double t2 = ((sign ? min : max)[currentaxis] - R0[currentaxis]) * inv_d[currentaxis];
 
 		if (t1 > tMin)
 			tMin = t1;
@@ -76,25 +67,14 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
-	// Transform the ray into the object's local coordinate space
-	vec3f pos = transform->globalToLocalCoords(r.getPosition());
-	vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-	double length = dir.length();
-	dir /= length;
-
-	ray localRay(pos, dir);
-
-	if (intersectLocal(localRay, i)) {
-		// Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
-		i.t /= length;
-
-		return true;
-	}
-	else {
-		return false;
-	}
+	return intersectThrough(r, i, [this](const ray& localRay, isect& hit) {
+		return intersectLocal(localRay, hit);
+	});
+}
 
+void Geometry::setTransform(TransformNode *node)
+{
+	transform = scene->transforms.add(node->localToGlobalMatrix());
 }
 
 bool Geometry::intersectLocal(const ray& r, isect& i) const
@@ -102,6 +82,21 @@ bool Geometry::intersectLocal(const ray& r, isect& i) const
 	return false;
 }
 
+bool SceneObject::transmits() const
+{
+	return !getMaterial().kt.iszero();
+}
+
+bool Geometry::occludes(const ray& r) const
+{
+	isect i;
+	Material m;
+	if (!intersect(r, i))
+		return false;
+	i.resolveMaterial(m);
+	return i.getMaterial().kt.iszero();
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -116,23 +111,23 @@ bool Geometry::hasBoundingBoxCapability() const
 	return false;
 }
 
+Scene::Scene()
+	: transformRoot(), objects(), lights(), opaque(false)
+{
+	static unsigned next_serial = 0;
+	serial = ++next_serial;
+}
+
 Scene::~Scene()
 {
 	giter g;
 	liter l;
 
+	// primitives and nonboundedobjects only refer to these
 	for (g = objects.begin(); g != objects.end(); ++g) {
 		delete (*g);
 	}
 
-	for (g = boundedobjects.begin(); g != boundedobjects.end(); ++g) {
-		delete (*g);
-	}
-
-	for (g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g) {
-		delete (*g);
-	}
-
 	for (l = lights.begin(); l != lights.end(); ++l) {
 		delete (*l);
 	}
@@ -141,40 +136,158 @@ Scene::~Scene()
 	{
 		delete l;
 	}
+
+	// after the objects, since instances refer to their prototype
+	for (auto& p : prototypes)
+	{
+		delete p.second;
+	}
+}
+
+void Scene::addPrototype(const string& name, Prototype* proto)
+{
+	prototypes[name] = proto;
+}
+
+const Prototype *Scene::getPrototype(const string& name) const
+{
+	map<string, Prototype*>::const_iterator p = prototypes.find(name);
+	return p != prototypes.end() ? p->second : NULL;
 }
 
 // Get any intersection with an object.  Return information about the
 // intersection through the reference parameter.
 bool Scene::intersect(const ray& r, isect& i) const
 {
-	typedef list<Geometry*>::const_iterator iter;
-	iter j;
-
 	isect cur;
 	bool have_one = false;
 
+	// the ray is clipped to the closest hit so far, so objects only report
+	// hits that are closer
+	ray probe(r);
+
 	// try the non-bounded objects
-	for (j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j) {
-		if ((*j)->intersect(r, cur)) {
-			if (!have_one || (cur.t < i.t)) {
-				i = cur;
-				have_one = true;
-			}
+	for (auto *obj : nonboundedobjects) {
+		if (obj->intersect(probe, cur)) {
+			i = cur;
+			have_one = true;
+			probe.setTMax(cur.t);
 		}
 	}
 
-	// try the bounded objects
-	for (j = boundedobjects.begin(); j != boundedobjects.end(); ++j) {
-		if ((*j)->intersect(r, cur)) {
-			if (!have_one || (cur.t < i.t)) {
-				i = cur;
-				have_one = true;
+	// try the bounded objects, nearest subtrees of the hierarchy first so
+	// that farther ones can be culled against the closest hit so far
+	if (primitives.intersect(probe, cur)) {
+		i = cur;
+		have_one = true;
+	}
+
+	return have_one;
+}
+
+RayPacket::Mask Scene::intersectPacket(RayPacket& p, isect *hits) const
+{
+	isect cur;
+	RayPacket::Mask found = 0;
+
+	for (int k = 0; k < p.size(); ++k) {
+		ray& probe = p.get(k);
+		for (auto *obj : nonboundedobjects) {
+			if (obj->intersect(probe, cur)) {
+				hits[k] = cur;
+				found |= 1ull << k;
+				probe.setTMax(cur.t);
 			}
 		}
 	}
 
+	return found | primitives.intersectPacket(p, hits);
+}
 
-	return have_one;
+bool Scene::occluded(const ray& r, double tMax, const Geometry **blocker) const
+{
+	ray segment(r);
+	segment.setTMax(minimum(tMax, r.getTMax()));
+
+	for (auto *obj : nonboundedobjects)
+	{
+		if (obj->occludes(segment))
+		{
+			if (blocker)
+				*blocker = obj;
+			return true;
+		}
+	}
+
+	auto blocksObject = [&](int k) -> bool
+	{
+		if (!primitives.occludes(k, segment))
+			return false;
+		if (blocker)
+			*blocker = primitives.object(k);
+		return true;
+	};
+	return primitives.any(segment, blocksObject);
+}
+
+vec3f Scene::transmittance(const ray& r, double tMax, double threshold,
+	const Geometry **blocker) const
+{
+	vec3f result(1.0, 1.0, 1.0);
+	isect cur;
+	Material hitMaterial;
+
+	tMax = minimum(tMax, r.getTMax());
+	ray clipped(r);
+	clipped.setTMax(tMax);
+
+	// Multiply in the kt of every surface of obj that the segment crosses,
+	// where hits(segment, cur) intersects obj.  Only obj is intersected
+	// again past each crossing, not the whole scene.  Returns true once too
+	// little light is left to matter.
+	auto attenuate = [&](const Geometry *obj, auto hits) -> bool
+	{
+		double start = 0.0;
+		ray segment(clipped);
+		while (hits(segment, cur))
+		{
+			cur.resolveMaterial(hitMaterial);
+			result = prod(result, cur.getMaterial().kt);
+			if (result[0] <= threshold && result[1] <= threshold
+				&& result[2] <= threshold)
+			{
+				if (blocker && cur.getMaterial().kt.iszero())
+					*blocker = obj;
+				return true;
+			}
+
+			// slightly push the point forward to prevent hitting itself
+			start += cur.t + RAY_EPSILON;
+			segment = ray(r.at(start), r.getDirection(), 0.0, tMax - start);
+		}
+		return false;
+	};
+
+	for (auto *obj : nonboundedobjects)
+	{
+		auto hits = [obj](const ray& segment, isect& i) {
+			return obj->intersect(segment, i);
+		};
+		if (attenuate(obj, hits))
+			return vec3f();
+	}
+
+	auto attenuateObject = [&](int k) -> bool
+	{
+		auto hits = [&](const ray& segment, isect& i) {
+			return primitives.intersect(k, segment, i);
+		};
+		return attenuate(primitives.object(k), hits);
+	};
+	if (primitives.any(clipped, attenuateObject))
+		return vec3f();
+
+	return result;
 }
 
 void Scene::initScene()
@@ -182,9 +295,16 @@ void Scene::initScene()
 	bool first_boundedobject = true;
 	BoundingBox b;
 
+	vector<Geometry*> boundedobjects;
+	nonboundedobjects.clear();
+
+	opaque = true;
 	typedef list<Geometry*>::const_iterator iter;
 	// split the objects into two categories: bounded and non-bounded
 	for (iter j = objects.begin(); j != objects.end(); ++j) {
+		if ((*j)->transmits())
+			opaque = false;
+
 		if ((*j)->hasBoundingBoxCapability())
 		{
 			boundedobjects.push_back(*j);
@@ -204,4 +324,7 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	// build the hierarchy over the world-space boxes that add() computed
+	primitives.build(boundedobjects);
 }
@@ -8,18 +8,25 @@
 #define __SCENE_H__
 
 #include <list>
+#include <vector>
+#include <map>
+#include <string>
 #include <algorithm>
 
 using namespace std;
 
 #include "ray.h"
+#include "bbox.h"
+#include "primitives.h"
 #include "material.h"
 #include "camera.h"
+#include "transforms.h"
 #include "../vecmath/vecmath.h"
 
 class Light;
 class AmbientLight;
 class Scene;
+class Prototype;
 
 class SceneElement
 {
@@ -35,26 +42,6 @@ protected:
 	Scene *scene;
 };
 
-class BoundingBox
-{
-public:
-	vec3f min;
-	vec3f max;
-
-	void operator=(const BoundingBox& target);
-
-	// Does this bounding box intersect the target?
-	bool intersects(const BoundingBox &target) const;
-
-	// does the box contain this point?
-	bool intersects(const vec3f& point) const;
-
-	// if the ray hits the box, put the "t" value of the intersection
-	// closest to the origin in tMin and the "t" value of the far intersection
-	// in tMax and return true, else return false.
-	bool intersect(const ray& r, double& tMin, double& tMax) const;
-};
-
 class TransformNode
 {
 protected:
@@ -73,9 +60,17 @@ public:
 	typedef list<TransformNode*>::const_iterator    child_citer;
 
 	~TransformNode()
+	{
+		releaseChildren();
+	}
+
+	// Delete the subtree below this node, once the objects in it have taken
+	// their entries in the scene's TransformTable.
+	void releaseChildren()
 	{
 		for (child_iter c = children.begin(); c != children.end(); ++c)
 			delete (*c);
+		children.clear();
 	}
 
 	TransformNode *createChild(const mat4f& xform)
@@ -106,6 +101,11 @@ public:
 		return (normi * v).normalize();
 	}
 
+	const mat4f& localToGlobalMatrix() const
+	{
+		return xform;
+	}
+
 protected:
 	// protected so that users can't directly construct one of these...
 	// force them to use the createChild() method.  Note that they CAN
@@ -141,10 +141,48 @@ public:
 	// intersections performed in the global coordinate space.
 	virtual bool intersect(const ray&r, isect&i) const;
 
+	// The work of intersect(): bring r into local space, hand it to
+	// local(localRay, i) and bring the hit back.  Callers that know the
+	// concrete class pass its intersectLocal() here so that it is called
+	// without going through the vtable.
+	template <class LocalFn>
+	bool intersectThrough(const ray& r, isect& i, LocalFn local) const
+	{
+		const Transform& xf = getTransform();
+
+		// an object placed as it is can take a unit ray unchanged
+		if (xf.isIdentity() && r.getDirection().length_squared() == 1.0)
+			return local(r, i);
+
+		// Transform the ray into the object's local coordinate space
+		vec3f pos = xf.globalToLocalCoords(r.getPosition());
+		vec3f dir = xf.globalToLocalVector(r.getDirection());
+		double length = dir.length();
+		dir /= length;
+
+		// distances along the local ray are scaled by length
+		ray localRay(pos, dir, r.getTMin() * length, r.getTMax() * length);
+
+		if (!local(localRay, i))
+			return false;
+
+		// Transform the intersection point & normal returned back into global space.
+		i.N = xf.localToGlobalCoordsNormal(i.N);
+		i.t /= length;
+		return true;
+	}
+
 	// intersections performed in the object's local coordinate space
 	// do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal(const ray& r, isect& i) const;
 
+	// does this object stop all light somewhere within r's interval?
+	bool occludes(const ray& r) const;
+
+	// Can any light pass through this object?  If nothing in the scene
+	// can, a shadow ray needs only an any-hit search.
+	virtual bool transmits() const { return true; }
+
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
@@ -158,49 +196,53 @@ public:
 		vec3f min = localBounds.min;
 		vec3f max = localBounds.max;
 
-		vec4f v, newMax, newMin;
+		const Transform& xf = getTransform();
+		vec3f v, newMax, newMin;
 
-		v = transform->localToGlobalCoords(vec4f(min[0], min[1], min[2], 1));
+		v = xf.localToGlobalCoords(vec3f(min[0], min[1], min[2]));
 		newMax = v;
 		newMin = v;
-		v = transform->localToGlobalCoords(vec4f(max[0], min[1], min[2], 1));
+		v = xf.localToGlobalCoords(vec3f(max[0], min[1], min[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords(vec4f(min[0], max[1], min[2], 1));
+		v = xf.localToGlobalCoords(vec3f(min[0], max[1], min[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords(vec4f(max[0], max[1], min[2], 1));
+		v = xf.localToGlobalCoords(vec3f(max[0], max[1], min[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords(vec4f(min[0], min[1], max[2], 1));
+		v = xf.localToGlobalCoords(vec3f(min[0], min[1], max[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords(vec4f(max[0], min[1], max[2], 1));
+		v = xf.localToGlobalCoords(vec3f(max[0], min[1], max[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords(vec4f(min[0], max[1], max[2], 1));
+		v = xf.localToGlobalCoords(vec3f(min[0], max[1], max[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords(vec4f(max[0], max[1], max[2], 1));
+		v = xf.localToGlobalCoords(vec3f(max[0], max[1], max[2]));
 		newMax = maximum(newMax, v);
 		newMin = minimum(newMin, v);
 
-		bounds.max = vec3f(newMax);
-		bounds.min = vec3f(newMin);
+		bounds.max = newMax;
+		bounds.min = newMin;
 	}
 
 	// default method for ComputeLocalBoundingBox returns a bogus bounding box;
 	// this should be overridden if hasBoundingBoxCapability() is true.
 	virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
-	void setTransform(TransformNode *transform) { this->transform = transform; };
+	// Place the object by the world transform of node, which may be freed
+	// afterwards.
+	void setTransform(TransformNode *node);
+	const Transform& getTransform() const;
 
 	Geometry(Scene *scene)
-		: SceneElement(scene) {}
+		: SceneElement(scene), transform(TransformTable::kIdentity) {}
 
 protected:
 	BoundingBox bounds;
-	TransformNode *transform;
+	int transform;		// index into the scene's TransformTable
 };
 
 // A SceneObject is a real actual thing that we want to model in the
@@ -214,6 +256,12 @@ public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial(Material *m) = 0;
 
+	// Fill in m and return true if the material at i differs from
+	// getMaterial(); see isect::resolveMaterial().
+	virtual bool interpolateMaterial(const isect&, Material&) const { return false; }
+
+	virtual bool transmits() const;
+
 protected:
 	SceneObject(Scene *scene)
 		: Geometry(scene) {}
@@ -248,11 +296,13 @@ public:
 	typedef list<Geometry*>::iterator 		giter;
 	typedef list<Geometry*>::const_iterator cgiter;
 
+	// The tree is only kept while the scene is read; objects refer to
+	// their entries in transforms.
 	TransformRoot transformRoot;
+	TransformTable transforms;
 
 public:
-	Scene()
-		: transformRoot(), objects(), lights() {}
+	Scene();
 	virtual ~Scene();
 
 	void add(Geometry* obj)
@@ -271,7 +321,33 @@ public:
 		m_ambient_lights.push_back(light);
 	}
 
+	// Named geometry definitions, shared by all of their instances.  The
+	// scene takes ownership of the prototype.
+	void addPrototype(const string& name, Prototype* proto);
+	const Prototype *getPrototype(const string& name) const;
+
 	bool intersect(const ray& r, isect& i) const;
+
+	// intersect() for every ray of a packet of camera rays, with the hit
+	// of ray k put in hits[k].  Returns the rays with hits.  The rays'
+	// intervals are clipped to them.
+	RayPacket::Mask intersectPacket(RayPacket& p, isect *hits) const;
+
+	// Any-hit query for shadow rays: is there an opaque object along r
+	// closer than tMax?  The search stops at the first one found, which is
+	// returned through blocker, if given.  In an isOpaque() scene it
+	// answers what transmittance() would, sooner.
+	bool occluded(const ray& r, double tMax,
+		const Geometry **blocker = NULL) const;
+
+	// The fraction of light that makes it along r up to tMax, i.e. the
+	// product of the transmissive colors of all surfaces crossed, gathered
+	// in a single traversal.  Gives up and returns black as soon as no
+	// component is above threshold, so an opaque hit ends it at once; that
+	// object is then returned through blocker, if given.
+	vec3f transmittance(const ray& r, double tMax, double threshold,
+		const Geometry **blocker = NULL) const;
+
 	void initScene();
 
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
@@ -289,15 +365,29 @@ public:
 
 	Camera *getCamera() { return &camera; }
 
+	// unique for every scene created, so that per-thread caches can tell
+	// whether what they hold belongs to this scene
+	unsigned getSerial() const { return serial; }
+
+	// no object transmits(), as of initScene()
+	bool isOpaque() const { return opaque; }
+
 
 
 private:
 	list<Geometry*> objects;
-	list<Geometry*> nonboundedobjects;
-	list<Geometry*> boundedobjects;
+	vector<Geometry*> nonboundedobjects;
+
+	// the objects with a bounding box, with the hierarchy over their
+	// world-space boxes, built by initScene().  Objects without a bounding
+	// box are tested separately.
+	PrimitiveStore primitives;
 	list<Light*> lights;
 	list<AmbientLight*> m_ambient_lights;
+	map<string, Prototype*> prototypes;
 	Camera camera;
+	unsigned serial;
+	bool opaque;
 
 	// Each object in the scene, provided that it has hasBoundingBoxCapability(),
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
@@ -305,4 +395,9 @@ private:
 	BoundingBox sceneBounds;
 };
 
+inline const Transform& Geometry::getTransform() const
+{
+	return scene->transforms[transform];
+}
+
 #endif // __SCENE_H__
@@ -0,0 +1,93 @@
+//
+// settings.h
+//
+// Everything a render needs to know about how to trace, captured once
+// before the render starts and read from there by the tracer, the
+// materials and the lights.  The GUI fills one in from its widgets with
+// TraceUI::getSettings(); text mode starts from the defaults, which are
+// the same as the GUI's.
+//
+// The on/off switches that change what a ray does at a hit are also
+// summed up as a feature mask, for choosing among the trace kernels
+// compiled for each combination.
+//
+
+#ifndef __SETTINGS_H__
+#define __SETTINGS_H__
+
+#include "../sampler.h"
+
+struct RenderSettings
+{
+	enum Feature
+	{
+		kShadows = 1 << 0,
+		kSoftShadows = 1 << 1,
+		kReflection = 1 << 2,
+		kRefraction = 1 << 3,
+		kFresnel = 1 << 4,
+		kNumFeatureSets = 1 << 5
+	};
+
+	RenderSettings()
+		: depth(0)
+		, intensityThreshold(0.01)
+		, shadows(true)
+		, softShadows(false)
+		, softShadowSamples(16)
+		, reflection(true)
+		, glossySamples(0)
+		, refraction(true)
+		, fresnel(false)
+		, fresnelRatio(1.0)
+		, occluderCache(true)
+		, overrideDistance(false)
+		, distanceConstant(0.25)
+		, distanceLinear(0.05)
+		, distanceQuadratic(0.01)
+		, superSampling(0)
+		, adaptiveThreshold(0.0)
+		, progressive(false)
+		, wavefront(false)
+		, binRays(true)
+		, sampler(Sampler::kSobol) {}
+
+	// the switches above as Feature bits; soft shadows only count with
+	// shadows on
+	unsigned features() const
+	{
+		return (shadows ? kShadows : 0)
+			| (shadows && softShadows ? kSoftShadows : 0)
+			| (reflection ? kReflection : 0)
+			| (refraction ? kRefraction : 0)
+			| (fresnel ? kFresnel : 0);
+	}
+
+	int depth;						// of reflection and refraction
+	double intensityThreshold;		// below which a ray is not traced
+
+	bool shadows;
+	bool softShadows;
+	int softShadowSamples;
+	bool reflection;
+	int glossySamples;				// 0 for a mirror
+	bool refraction;
+	bool fresnel;
+	double fresnelRatio;
+	bool occluderCache;
+
+	// distance attenuation for every point light, in place of the scene's
+	bool overrideDistance;
+	double distanceConstant;
+	double distanceLinear;
+	double distanceQuadratic;
+
+	int superSampling;				// n for n*n samples per pixel, or 0
+	double adaptiveThreshold;		// 0 to take every sample everywhere
+	bool progressive;
+	bool wavefront;					// breadth-first, in ray queues
+	bool binRays;					// sort each wave before tracing it
+	Sampler::Kind sampler;
+};
+
+#endif // __SETTINGS_H__
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "stats.h"
+
+RenderStats renderStats;
+thread_local RenderCounters renderCounters;
+
+void RenderStats::reset()
+{
+	occluder_lookups = 0;
+	occluder_hits = 0;
+	rays = 0;
+	allocations = 0;
+	samples = 0;
+	pixels = 0;
+	binned_rays = 0;
+	binned_repeats = 0;
+	spawned_repeats = 0;
+}
+
+void RenderCounters::flush()
+{
+	renderStats.rays += rays;
+	renderStats.allocations += allocations;
+	renderStats.samples += samples;
+	renderStats.pixels += pixels;
+	renderStats.binned_rays += binned_rays;
+	renderStats.binned_repeats += binned_repeats;
+	renderStats.spawned_repeats += spawned_repeats;
+	discard();
+}
+
+void RenderCounters::discard()
+{
+	*this = RenderCounters();
+}
+
+std::string RenderStats::summary() const
+{
+	// built a clause at a time; each fits buf whatever the counts
+	std::string result;
+	char buf[128];
+	const long long lookups = occluder_lookups;
+	if (lookups == 0)
+	{
+		result += "no occluder cache lookups";
+	}
+	else
+	{
+		const long long hits = occluder_hits;
+		snprintf(buf, sizeof(buf), "occluder cache %lld/%lld hits (%.1f%%)",
+			hits, lookups, 100.0 * hits / lookups);
+		result += buf;
+	}
+
+	const long long traced = rays;
+	if (traced > 0)
+	{
+		const long long allocs = allocations;
+		snprintf(buf, sizeof(buf), ", %lld allocations for %lld rays (%.3f per ray)",
+			allocs, traced, (double)allocs / traced);
+		result += buf;
+	}
+
+	const long long filled = pixels;
+	if (filled > 0)
+	{
+		snprintf(buf, sizeof(buf), ", %.2f samples per pixel",
+			(double)samples / filled);
+		result += buf;
+	}
+
+	const long long binned = binned_rays;
+	if (binned > 0)
+	{
+		snprintf(buf, sizeof(buf), ", %.1f%% of binned rays hit the same"
+			" object as the one before (%.1f%% as spawned)",
+			100.0 * binned_repeats / binned, 100.0 * spawned_repeats / binned);
+		result += buf;
+	}
+	return result;
+}
+
+// Count every allocation, on the thread making it.  renderCounters is
+// plain data, zero before anything runs, so the count is safe to bump
+// from static initializers elsewhere.
+
+void *operator new(size_t size)
+{
+	++renderCounters.allocations;
+	if (size == 0)
+		size = 1;
+	while (true)
+	{
+		if (void *p = malloc(size))
+			return p;
+		std::new_handler handler = std::get_new_handler();
+		if (handler == NULL)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
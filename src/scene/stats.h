@@ -0,0 +1,75 @@
+//
+// stats.h
+//
+// Counters gathered while rendering.  The tracer bumps the plain ones in
+// its thread's RenderCounters, which touch nothing shared, and each render
+// thread adds them into the atomic totals in renderStats once per tile.
+// reset() the totals before a render and read them back with summary()
+// once it is done.
+//
+// allocations counts the calls of the global operator new, which
+// stats.cpp replaces for the purpose, made while a tile is traced.
+// Tracing a ray should not allocate at all, so in steady state it stays
+// near zero.
+//
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <atomic>
+#include <string>
+
+struct RenderStats
+{
+	// shadow queries that went through the last-occluder cache, and how
+	// many of those were settled by the cached object alone
+	std::atomic<long long> occluder_lookups;
+	std::atomic<long long> occluder_hits;
+
+	// rays traced, of every kind but shadow rays, and heap allocations
+	// made in the meantime
+	std::atomic<long long> rays;
+	std::atomic<long long> allocations;
+
+	// camera samples taken and pixels they went to
+	std::atomic<long long> samples;
+	std::atomic<long long> pixels;
+
+	// secondary rays traced in bins by the wavefront integrator, how many
+	// hit the same object as the ray traced before them, and how many
+	// would have in the order they were spawned: a stand-in for how much
+	// locality the binning buys, not a count of cache misses
+	std::atomic<long long> binned_rays;
+	std::atomic<long long> binned_repeats;
+	std::atomic<long long> spawned_repeats;
+
+	RenderStats() { reset(); }
+
+	void reset();
+
+	// one line summary of the counters, for reporting after a render
+	std::string summary() const;
+};
+
+extern RenderStats renderStats;
+
+// What one thread has counted since its last flush().  A render thread
+// discard()s whatever it counted outside tracing, such as the GUI's
+// allocations, before a tile and flush()es the tile's counts after it.
+struct RenderCounters
+{
+	long long rays;
+	long long allocations;
+	long long samples;
+	long long pixels;
+	long long binned_rays;
+	long long binned_repeats;
+	long long spawned_repeats;
+
+	void flush();
+	void discard();
+};
+
+extern thread_local RenderCounters renderCounters;
+
+#endif // __STATS_H__
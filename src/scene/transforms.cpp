@@ -0,0 +1,50 @@
+#include "transforms.h"
+
+Transform::Transform(const mat4f& world)
+{
+	const mat4f inv = world.inverse();
+	for (int row = 0; row < 3; ++row)
+	{
+		xform[row] = world[row];
+		inverse[row] = inv[row];
+	}
+	normi = world.upper33().inverse().transpose();
+
+	affine = world[3][0] == 0.0 && world[3][1] == 0.0
+		&& world[3][2] == 0.0 && world[3][3] == 1.0;
+	identity = affine;
+	for (int row = 0; row < 3; ++row)
+	{
+		for (int col = 0; col < 4; ++col)
+		{
+			if (world[row][col] != (row == col ? 1.0 : 0.0))
+				identity = false;
+		}
+	}
+}
+
+int TransformTable::add(const mat4f& world)
+{
+	Key key;
+	for (int row = 0; row < 4; ++row)
+	{
+		for (int col = 0; col < 4; ++col)
+			key[row * 4 + col] = world[row][col];
+	}
+
+	std::map<Key, int>::const_iterator found = lookup.find(key);
+	if (found != lookup.end())
+		return found->second;
+
+	const int k = (int)entries.size();
+	entries.push_back(Transform(world));
+	lookup[key] = k;
+	return k;
+}
+
+void TransformTable::clear()
+{
+	entries.clear();
+	lookup.clear();
+	add(mat4f());
+}
@@ -0,0 +1,93 @@
+//
+// transforms.h
+//
+// The compiled form of the TransformNode tree.  While a scene is read,
+// every object asks the table for the index of its world transform; equal
+// matrices share one entry, and entry 0 is the identity.  Each entry keeps
+// only the three rows of the affine matrix and of its inverse, and the
+// normal matrix, next to the others in one array.  Once the objects have
+// their indices the tree itself is no longer needed and is freed.
+//
+
+#ifndef __TRANSFORMS_H__
+#define __TRANSFORMS_H__
+
+#include <array>
+#include <map>
+#include <vector>
+
+#include "../vecmath/vecmath.h"
+
+class Transform
+{
+public:
+	explicit Transform(const mat4f& world);
+
+	bool isIdentity() const { return identity; }
+
+	// Does the bottom row leave w alone?  Points are mapped by the top
+	// three rows either way, as by TransformNode.
+	bool isAffine() const { return affine; }
+
+	vec3f globalToLocalCoords(const vec3f& p) const
+	{
+		return vec3f(p * inverse[0], p * inverse[1], p * inverse[2]);
+	}
+
+	// a direction: the translation is left out
+	vec3f globalToLocalVector(const vec3f& v) const
+	{
+		return vec3f(v * vec3f(inverse[0]), v * vec3f(inverse[1]), v * vec3f(inverse[2]));
+	}
+
+	vec3f localToGlobalCoords(const vec3f& p) const
+	{
+		return vec3f(p * xform[0], p * xform[1], p * xform[2]);
+	}
+
+	vec3f localToGlobalCoordsNormal(const vec3f& n) const
+	{
+		return (normi * n).normalize();
+	}
+
+	// the top three rows, over (0, 0, 0, 1)
+	mat4f localToGlobalMatrix() const
+	{
+		return mat4f(xform[0], xform[1], xform[2], vec4f(0.0, 0.0, 0.0, 1.0));
+	}
+
+private:
+	// top three rows of the matrix and of its inverse
+	vec4f xform[3];
+	vec4f inverse[3];
+	mat3f normi;
+	bool identity;
+	bool affine;
+};
+
+class TransformTable
+{
+public:
+	static const int kIdentity = 0;
+
+	TransformTable() { clear(); }
+
+	// the index of the entry for world, added if there is none yet
+	int add(const mat4f& world);
+	void clear();
+
+	// Free the lookup once the scene has been read.  Later additions still
+	// work but are no longer shared.
+	void compact() { lookup.clear(); }
+
+	int size() const { return (int)entries.size(); }
+	const Transform& operator[](int k) const { return entries[k]; }
+
+private:
+	typedef std::array<double, 16> Key;	// the matrix, row by row
+
+	std::vector<Transform> entries;
+	std::map<Key, int> lookup;
+};
+
+#endif // __TRANSFORMS_H__
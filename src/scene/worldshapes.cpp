@@ -0,0 +1,253 @@
+#include <cmath>
+#include <limits>
+
+#include "worldshapes.h"
+#include "scene.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+
+namespace
+{
+
+	// How far from orthogonal the columns of a sphere's transform may be,
+	// relative to their squared length.  Rotations built from cos and sin
+	// are off by a few ulps.
+	const double kSimilarityTolerance = 1.0e-12;
+
+	// the object's transform, if it maps w to 1
+	bool affineXform(const Geometry *obj, mat4f& m)
+	{
+		const Transform& xf = obj->getTransform();
+		if (!xf.isAffine())
+			return false;
+		m = xf.localToGlobalMatrix();
+		return true;
+	}
+
+	// Fill in the diagonal of m's upper 3x3 and its translation, if
+	// everything else is zero.
+	bool diagonal(const mat4f& m, vec3f& scale, vec3f& translation)
+	{
+		for (int row = 0; row < 3; ++row)
+		{
+			for (int col = 0; col < 3; ++col)
+			{
+				if (row != col && m[row][col] != 0.0)
+					return false;
+			}
+			if (m[row][row] == 0.0)
+				return false;
+			scale[row] = m[row][row];
+			translation[row] = m[row][3];
+		}
+		return true;
+	}
+
+}
+
+bool WorldSphere::match(const Sphere *obj, WorldSphere& s)
+{
+	mat4f m;
+	if (!affineXform(obj, m))
+		return false;
+
+	const mat3f a = m.upper33();
+	const vec3f cols[3] = { a.column(0), a.column(1), a.column(2) };
+	const double scale2 = cols[0].length_squared();
+	if (scale2 == 0.0)
+		return false;
+
+	const double tolerance = kSimilarityTolerance * scale2;
+	for (int j = 0; j < 3; ++j)
+	{
+		if (fabs(cols[j].length_squared() - scale2) > tolerance)
+			return false;
+		for (int k = j + 1; k < 3; ++k)
+		{
+			if (fabs(cols[j].dot(cols[k])) > tolerance)
+				return false;
+		}
+	}
+
+	s.obj = obj;
+	s.center = vec3f(m[0][3], m[1][3], m[2][3]);
+	s.radius = sqrt(scale2);
+	return true;
+}
+
+// Sphere::intersectLocal() on the unit sphere, with the ray brought there
+// by the translation and scale alone.  The rotation does not change the
+// sphere, and leaving it out leaves the normal in world space already.
+bool WorldSphere::intersect(const ray& r, isect& i) const
+{
+	const double inv_radius = 1.0 / radius;
+	const vec3f pos = (r.getPosition() - center) * inv_radius;
+	vec3f dir = r.getDirection() * inv_radius;
+	const double length = dir.length();
+	dir /= length;
+
+	const vec3f v = -pos;
+	const double b = v.dot(dir);
+	double discriminant = b*b - v.dot(v) + 1;
+
+	if (discriminant < 0.0) {
+		return false;
+	}
+
+	discriminant = sqrt(discriminant);
+	const double t_min = r.getTMin() * length;
+	const double t2 = b + discriminant;
+
+	if (t2 <= RAY_EPSILON || t2 <= t_min) {
+		return false;
+	}
+
+	const double t1 = b - discriminant;
+	const double t = (t1 > RAY_EPSILON && t1 > t_min) ? t1 : t2;
+
+	if (t >= r.getTMax() * length) {
+		return false;
+	}
+
+	i.obj = obj;
+	i.t = t / length;
+	i.N = (pos + dir * t).normalize();
+	return true;
+}
+
+bool WorldBox::match(const Box *obj, WorldBox& b)
+{
+	mat4f m;
+	vec3f scale, center;
+	if (!affineXform(obj, m) || !diagonal(m, scale, center))
+		return false;
+
+	b.obj = obj;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const double half = 0.5 * fabs(scale[axis]);
+		b.min[axis] = center[axis] - half;
+		b.max[axis] = center[axis] + half;
+	}
+	return true;
+}
+
+// Box::intersectLocal() against the box's world-space slabs.  With only an
+// axis-aligned scale in the way, the local and world normals agree.
+bool WorldBox::intersect(const ray& r, isect& i) const
+{
+	const vec3f& p = r.getPosition();
+	const vec3f& inv_d = r.getInverseDirection();
+	double tnear = -std::numeric_limits<double>::max();
+	double tfar = std::numeric_limits<double>::max();
+	int tnear_axis = 0;
+	int tfar_axis = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (r.getDirection()[axis] == 0)
+		{
+			// parallel to plane
+			if (p[axis] < min[axis] || p[axis] > max[axis])
+			{
+				return false;
+			}
+			continue;
+		}
+
+		const bool sign = r.getSign(axis) != 0;
+		double t1 = ((sign ? max : min)[axis] - p[axis]) * inv_d[axis];
+		double t2 = ((sign ? min : max)[axis] - p[axis]) * inv_d[axis];
+		if (t1 > tnear)
+		{
+			tnear = t1;
+			tnear_axis = axis;
+		}
+		if (t2 < tfar)
+		{
+			tfar = t2;
+			tfar_axis = axis;
+		}
+		if (tnear > tfar || tfar <= r.getTMin() || tnear >= r.getTMax())
+		{
+			// missed || outside the ray's interval
+			return false;
+		}
+	}
+
+	i.obj = obj;
+	if (tnear > r.getTMin())
+	{
+		// entering: the normal faces against the ray
+		i.t = tnear;
+		i.N = vec3f(0.0, 0.0, 0.0);
+		i.N[tnear_axis] = r.getSign(tnear_axis) ? 1.0 : -1.0;
+	}
+	else if (tfar < r.getTMax())
+	{
+		// starting inside the box: report where the ray leaves it
+		i.t = tfar;
+		i.N = vec3f(0.0, 0.0, 0.0);
+		i.N[tfar_axis] = r.getSign(tfar_axis) ? -1.0 : 1.0;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+bool WorldSquare::match(const Square *obj, WorldSquare& q)
+{
+	mat4f m;
+	vec3f scale, center;
+	if (!affineXform(obj, m) || !diagonal(m, scale, center))
+		return false;
+
+	q.obj = obj;
+	q.center = center;
+	for (int axis = 0; axis < 3; ++axis)
+		q.invScale[axis] = 1.0 / scale[axis];
+	return true;
+}
+
+// Square::intersectLocal() with the ray scaled into the square's space but
+// its direction left unnormalised, so that t comes out in world units.
+bool WorldSquare::intersect(const ray& r, isect& i) const
+{
+	const vec3f& d = r.getDirection();
+	if (d[2] == 0.0) {
+		return false;
+	}
+
+	const vec3f p = prod(r.getPosition() - center, invScale);
+	const vec3f dir = prod(d, invScale);
+	const double t = -p[2] / dir[2];
+
+	// the local test's epsilon is in local units
+	if (t * dir.length() <= RAY_EPSILON || !r.inRange(t)) {
+		return false;
+	}
+
+	const vec3f P = p + dir * t;
+
+	if (P[0] < -0.5 || P[0] > 0.5) {
+		return false;
+	}
+
+	if (P[1] < -0.5 || P[1] > 0.5) {
+		return false;
+	}
+
+	// the local normal faces against the local ray, and the scale flips
+	// both or neither
+	i.obj = obj;
+	i.t = t;
+	if (d[2] > 0.0) {
+		i.N = vec3f(0.0, 0.0, -1.0);
+	} else {
+		i.N = vec3f(0.0, 0.0, 1.0);
+	}
+	return true;
+}
@@ -0,0 +1,63 @@
+//
+// worldshapes.h
+//
+// Spheres, boxes and squares whose transforms are simple enough to be
+// folded into a few world-space parameters.  A sphere under any rotation,
+// uniform scale and translation is a centre and a radius; a box or square
+// under an axis-aligned scale and translation is a centre and a half-size
+// per axis.  PrimitiveStore::build() matches its objects against these and
+// intersects the ones that fit in closed form, without the matrix products
+// of Geometry::intersectThrough().  Anything else keeps the transform path.
+//
+// The tests give the same t and normal as the transform path, including
+// where the local tests compare against RAY_EPSILON in local units.
+//
+
+#ifndef __WORLDSHAPES_H__
+#define __WORLDSHAPES_H__
+
+#include "../vecmath/vecmath.h"
+
+class ray;
+class isect;
+class Sphere;
+class Box;
+class Square;
+
+struct WorldSphere
+{
+	const Sphere *obj;
+	vec3f center;
+	double radius;
+
+	// Fill in s if obj's transform is a similarity.
+	static bool match(const Sphere *obj, WorldSphere& s);
+
+	bool intersect(const ray& r, isect& i) const;
+};
+
+struct WorldBox
+{
+	const Box *obj;
+	vec3f min;
+	vec3f max;
+
+	// Fill in b if obj's transform is an axis-aligned scale and translation.
+	static bool match(const Box *obj, WorldBox& b);
+
+	bool intersect(const ray& r, isect& i) const;
+};
+
+struct WorldSquare
+{
+	const Square *obj;
+	vec3f center;
+	vec3f invScale;		// 1 / the scale along each axis, sign included
+
+	// Fill in q if obj's transform is an axis-aligned scale and translation.
+	static bool match(const Square *obj, WorldSquare& q);
+
+	bool intersect(const ray& r, isect& i) const;
+};
+
+#endif // __WORLDSHAPES_H__
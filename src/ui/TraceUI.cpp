@@ -6,14 +6,15 @@
 #include <cstdio>
 #include <ctime>
 #include <cstring>
+#include <algorithm>
 #include <chrono>
-#include <future>
-#include <vector>
 
 #include <FL/fl_ask.H>
 
 #include "TraceUI.h"
 #include "../RayTracer.h"
+#include "../scene/stats.h"
+#include "../fileio/bitmap.h"
 
 static bool done;
 
@@ -40,11 +41,11 @@ void TraceUI::load_scene(const char *file)
 	char buf[256];
 
 	if (raytracer->loadScene(file)) {
-		sprintf(buf, "Ray <%s>", file);
+		snprintf(buf, sizeof(buf), "Ray <%s>", file);
 		done = true;	// terminate the previous rendering
 	}
 	else {
-		sprintf(buf, "Ray <Not Loaded>");
+		snprintf(buf, sizeof(buf), "Ray <Not Loaded>");
 	}
 
 	m_mainWindow->label(buf);
@@ -61,6 +62,19 @@ void TraceUI::cb_save_image(Fl_Menu_* o, void* v)
 	}
 }
 
+void TraceUI::cb_save_heatmap(Fl_Menu_* o, void* v)
+{
+	TraceUI* pUI = whoami(o);
+
+	char* savefile = fl_file_chooser("Save Sample Heatmap?", "*.bmp", "heatmap.bmp");
+	if (savefile != NULL) {
+		unsigned char* buf;
+		int w, h;
+		pUI->raytracer->getSampleHeatmap(buf, w, h);
+		writeBMP(savefile, w, h, buf);
+	}
+}
+
 void TraceUI::cb_exit(Fl_Menu_* o, void* v)
 {
 	TraceUI* pUI = whoami(o);
@@ -117,6 +131,18 @@ void TraceUI::cb_reflectionSwitch(Fl_Widget *o, void*)
 	((TraceUI*)(o->user_data()))->m_isReflection ^= true;
 }
 
+void TraceUI::cb_softShadowSlides(Fl_Widget* o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_softShadowSample =
+		((Fl_Slider*)o)->value();
+}
+
+void TraceUI::cb_samplerChoice(Fl_Widget* o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_sampler =
+		(Sampler::Kind)((Fl_Choice*)o)->value();
+}
+
 void TraceUI::cb_glossyReflectionSlides(Fl_Widget* o, void*)
 {
 	((TraceUI*)(o->user_data()))->m_glossySample =
@@ -139,6 +165,26 @@ void TraceUI::cb_refractionSwitch(Fl_Widget *o, void*)
 	((TraceUI*)(o->user_data()))->m_isRefraction ^= true;
 }
 
+void TraceUI::cb_occluderCacheSwitch(Fl_Widget *o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_isOccluderCache ^= true;
+}
+
+void TraceUI::cb_progressiveSwitch(Fl_Widget *o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_isProgressive ^= true;
+}
+
+void TraceUI::cb_wavefrontSwitch(Fl_Widget *o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_isWavefront ^= true;
+}
+
+void TraceUI::cb_binningSwitch(Fl_Widget *o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_isBinning ^= true;
+}
+
 void TraceUI::cb_threadSlides(Fl_Widget* o, void*)
 {
 	((TraceUI*)(o->user_data()))->m_thread = ((Fl_Slider*)o)->value();
@@ -154,6 +200,11 @@ void TraceUI::cb_superSamplingSlides(Fl_Widget* o, void*)
 	((TraceUI*)(o->user_data()))->m_superSampling = ((Fl_Slider*)o)->value();
 }
 
+void TraceUI::cb_adaptiveSlides(Fl_Widget* o, void*)
+{
+	((TraceUI*)(o->user_data()))->m_adaptiveThreshold = ((Fl_Slider*)o)->value();
+}
+
 void TraceUI::cb_distanceSwitch(Fl_Widget *o, void*)
 {
 	((TraceUI*)(o->user_data()))->m_isOveride ^= true;
@@ -174,16 +225,31 @@ void TraceUI::cb_aQuadraticSlides(Fl_Widget* o, void*)
 	((TraceUI*)(o->user_data()))->m_aQuadratic = ((Fl_Slider*)o)->value();
 }
 
-void TraceUI::RenderWorker(TraceUI *ui, const int from_y, const int to_y,
-	const int w)
+RenderSettings TraceUI::getSettings() const
 {
-	for (int y = from_y; y < to_y && !done; ++y)
-	{
-		for (int x = 0; x < w && !done; ++x)
-		{
-			ui->raytracer->tracePixel(x, y);
-		}
-	}
+	RenderSettings s;
+	s.depth = m_nDepth;
+	s.intensityThreshold = m_intensity;
+	s.shadows = m_isShadow;
+	s.softShadows = m_isSoftShadow;
+	s.softShadowSamples = m_softShadowSample;
+	s.reflection = m_isReflection;
+	s.glossySamples = m_glossySample;
+	s.refraction = m_isRefraction;
+	s.fresnel = m_isFresnel;
+	s.fresnelRatio = m_fresnelRatio;
+	s.occluderCache = m_isOccluderCache;
+	s.overrideDistance = m_isOveride;
+	s.distanceConstant = m_aConstant;
+	s.distanceLinear = m_aLinear;
+	s.distanceQuadratic = m_aQuadratic;
+	s.superSampling = m_superSampling;
+	s.adaptiveThreshold = m_adaptiveThreshold;
+	s.progressive = m_isProgressive;
+	s.wavefront = m_isWavefront;
+	s.binRays = m_isBinning;
+	s.sampler = m_sampler;
+	return s;
 }
 
 void TraceUI::cb_render(Fl_Widget* o, void* v)
@@ -204,13 +270,12 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 
 		pUI->m_traceGlWindow->show();
 
-		pUI->raytracer->traceSetup(width, height);
-
-		// Save the window label
-		const char *old_label = pUI->m_traceGlWindow->label();
+		pUI->raytracer->traceSetup(width, height, pUI->getSettings());
 
 		// start to render here
 		done = false;
+		renderStats.reset();
+		const auto start = chrono::steady_clock::now();
 		clock_t prev, now;
 		prev = clock();
 
@@ -218,17 +283,9 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 		Fl::check();
 		Fl::flush();
 
-		vector<future<void>> workers;
-		const int partition = height / pUI->GetThread();
-		for (int i = 0; i < pUI->GetThread() - 1; ++i)
-		{
-			workers.push_back(async(launch::async, RenderWorker, pUI,
-				partition * i, partition * (i + 1), width));
-		}
-		workers.push_back(async(launch::async, RenderWorker, pUI,
-			partition * (pUI->GetThread() - 1), height, width));
+		pUI->raytracer->traceStart(pUI->GetThread());
 
-		bool is_all_joined = false;
+		bool is_finished = false;
 		do
 		{
 			// current time
@@ -240,6 +297,15 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 				prev = now;
 
 				if (Fl::ready()) {
+					// a progressive render shows how far it has got
+					int pass, passes;
+					pUI->raytracer->traceProgress(pass, passes);
+					if (passes > 1) {
+						snprintf(buffer, sizeof(buffer), "Rendering - pass %d of %d",
+							pass, passes);
+						pUI->m_traceGlWindow->copy_label(buffer);
+					}
+
 					// refresh
 					pUI->m_traceGlWindow->refresh();
 					// check event
@@ -251,22 +317,21 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 				}
 			}
 
-			is_all_joined = true;
-			for (const auto &w : workers)
-			{
-				if (w.wait_for(chrono::milliseconds(100))
-					!= future_status::ready)
-				{
-					is_all_joined = false;
-				}
-			}
-		} while (!is_all_joined);
+			// stopped, closed or given a new scene while checking events
+			if (done)
+				pUI->raytracer->traceStop();
+
+			is_finished = pUI->raytracer->traceWait(100);
+		} while (!is_finished);
 
 		done = true;
 		pUI->m_traceGlWindow->refresh();
 
-		// Restore the window label
-		pUI->m_traceGlWindow->label(old_label);
+		// Show the render statistics in place of the window label
+		const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		snprintf(buffer, sizeof(buffer), "Rendered Image - %.2fs, ",
+			elapsed.count());
+		pUI->m_traceGlWindow->copy_label((buffer + renderStats.summary()).c_str());
 	}
 }
 
@@ -291,6 +356,7 @@ Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
 	{ "&Load Scene...",	FL_ALT + 'l', (Fl_Callback *)TraceUI::cb_load_scene },
 	{ "&Save Image...",	FL_ALT + 's', (Fl_Callback *)TraceUI::cb_save_image },
+	{ "Save &Heatmap...",	FL_ALT + 'h', (Fl_Callback *)TraceUI::cb_save_heatmap },
 	{ "&Exit",			FL_ALT + 'e', (Fl_Callback *)TraceUI::cb_exit },
 	{ 0 },
 
@@ -302,24 +368,32 @@ Fl_Menu_Item TraceUI::menuitems[] = {
 };
 
 TraceUI::TraceUI() {
-	// init.
-	m_nDepth = 0;
+	// init. from the defaults text mode renders with
+	const RenderSettings defaults;
+	m_nDepth = defaults.depth;
 	m_nSize = 150;
-	m_isShadow = true;
-	m_isSoftShadow = false;
-	m_isReflection = true;
-	m_glossySample = 0;
-	m_isFresnel = false;
-	m_fresnelRatio = 1.0;
-	m_isRefraction = true;
-	m_thread = 2;
-	m_intensity = 0.01;
-	m_superSampling = 0;
-	m_isOveride = false;
-	m_aConstant = 0.25;
-	m_aLinear = 0.05;
-	m_aQuadratic = 0.01;
-	m_mainWindow = new Fl_Window(100, 40, 430, 405, "Ray <Not Loaded>");
+	m_isShadow = defaults.shadows;
+	m_isSoftShadow = defaults.softShadows;
+	m_isReflection = defaults.reflection;
+	m_glossySample = defaults.glossySamples;
+	m_softShadowSample = defaults.softShadowSamples;
+	m_sampler = defaults.sampler;
+	m_isFresnel = defaults.fresnel;
+	m_fresnelRatio = defaults.fresnelRatio;
+	m_isRefraction = defaults.refraction;
+	m_isOccluderCache = defaults.occluderCache;
+	m_isProgressive = defaults.progressive;
+	m_isWavefront = defaults.wavefront;
+	m_isBinning = defaults.binRays;
+	m_thread = RenderPool::defaultWorkers();
+	m_intensity = defaults.intensityThreshold;
+	m_superSampling = defaults.superSampling;
+	m_adaptiveThreshold = defaults.adaptiveThreshold;
+	m_isOveride = defaults.overrideDistance;
+	m_aConstant = defaults.distanceConstant;
+	m_aLinear = defaults.distanceLinear;
+	m_aQuadratic = defaults.distanceQuadratic;
+	m_mainWindow = new Fl_Window(100, 40, 430, 480, "Ray <Not Loaded>");
 	m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 											// install menu bar
 	m_menubar = new Fl_Menu_Bar(0, 0, 420, 25);
@@ -419,7 +493,7 @@ TraceUI::TraceUI() {
 	m_fresnelSlider->minimum(0);
 	m_fresnelSlider->maximum(100);
 	m_fresnelSlider->step(1);
-	m_fresnelSlider->value(100);
+	m_fresnelSlider->value(m_fresnelRatio * 100);
 	m_fresnelSlider->align(FL_ALIGN_RIGHT);
 	m_fresnelSlider->callback(cb_fresnelSlides);
 
@@ -429,7 +503,7 @@ TraceUI::TraceUI() {
 	m_threadSlider->labelfont(FL_COURIER);
 	m_threadSlider->labelsize(12);
 	m_threadSlider->minimum(1);
-	m_threadSlider->maximum(8);
+	m_threadSlider->maximum(max(8, m_thread));
 	m_threadSlider->step(1);
 	m_threadSlider->value(m_thread);
 	m_threadSlider->align(FL_ALIGN_RIGHT);
@@ -449,29 +523,83 @@ TraceUI::TraceUI() {
 
 	m_shadowSwitch = new Fl_Light_Button(10, 280, 260, 20, "Shadow");
 	m_shadowSwitch->user_data((void*)(this));
-	m_shadowSwitch->value(1);
+	m_shadowSwitch->value(m_isShadow);
 	m_shadowSwitch->callback(cb_shadowSwitch);
 
 	m_reflectionSwitch = new Fl_Light_Button(10, 305, 260, 20, "Reflection");
 	m_reflectionSwitch->user_data((void*)(this));
-	m_reflectionSwitch->value(1);
+	m_reflectionSwitch->value(m_isReflection);
 	m_reflectionSwitch->callback(cb_reflectionSwitch);
 
 	m_refractionSwitch = new Fl_Light_Button(10, 330, 260, 20, "Refraction");
 	m_refractionSwitch->user_data((void*)(this));
-	m_refractionSwitch->value(1);
+	m_refractionSwitch->value(m_isRefraction);
 	m_refractionSwitch->callback(cb_refractionSwitch);
 
 	m_softShadowSwitch = new Fl_Light_Button(10, 355, 260, 20, "Soft Shadow");
 	m_softShadowSwitch->user_data((void*)(this));
-	m_softShadowSwitch->value(0);
+	m_softShadowSwitch->value(m_isSoftShadow);
 	m_softShadowSwitch->callback(cb_softShadowSwitch);
 
 	m_fresnelSwitch = new Fl_Light_Button(10, 380, 260, 20, "Fresnel");
 	m_fresnelSwitch->user_data((void*)(this));
-	m_fresnelSwitch->value(0);
+	m_fresnelSwitch->value(m_isFresnel);
 	m_fresnelSwitch->callback(cb_fresnelSwitch);
 
+	m_softShadowSlider = new Fl_Value_Slider(10, 405, 260, 20, "Soft Shadow Rays");
+	m_softShadowSlider->user_data((void*)(this));
+	m_softShadowSlider->type(FL_HOR_NICE_SLIDER);
+	m_softShadowSlider->labelfont(FL_COURIER);
+	m_softShadowSlider->labelsize(12);
+	m_softShadowSlider->minimum(1);
+	m_softShadowSlider->maximum(64);
+	m_softShadowSlider->step(1);
+	m_softShadowSlider->value(m_softShadowSample);
+	m_softShadowSlider->align(FL_ALIGN_RIGHT);
+	m_softShadowSlider->callback(cb_softShadowSlides);
+
+	m_samplerChoice = new Fl_Choice(10, 430, 260, 20, "Sampler");
+	m_samplerChoice->user_data((void*)(this));
+	m_samplerChoice->labelfont(FL_COURIER);
+	m_samplerChoice->labelsize(12);
+	for (int k = 0; k < Sampler::kNumKinds; ++k)
+		m_samplerChoice->add(Sampler::Name((Sampler::Kind)k));
+	m_samplerChoice->value(m_sampler);
+	m_samplerChoice->align(FL_ALIGN_RIGHT);
+	m_samplerChoice->callback(cb_samplerChoice);
+
+	m_adaptiveSlider = new Fl_Value_Slider(10, 455, 260, 20, "Adaptive Threshold");
+	m_adaptiveSlider->user_data((void*)(this));
+	m_adaptiveSlider->type(FL_HOR_NICE_SLIDER);
+	m_adaptiveSlider->labelfont(FL_COURIER);
+	m_adaptiveSlider->labelsize(12);
+	m_adaptiveSlider->minimum(0.0);
+	m_adaptiveSlider->maximum(0.1);
+	m_adaptiveSlider->step(0.001);
+	m_adaptiveSlider->value(m_adaptiveThreshold);
+	m_adaptiveSlider->align(FL_ALIGN_RIGHT);
+	m_adaptiveSlider->callback(cb_adaptiveSlides);
+
+	m_occluderCacheSwitch = new Fl_Light_Button(280, 380, 140, 20, "Occluder Cache");
+	m_occluderCacheSwitch->user_data((void*)(this));
+	m_occluderCacheSwitch->value(m_isOccluderCache);
+	m_occluderCacheSwitch->callback(cb_occluderCacheSwitch);
+
+	m_progressiveSwitch = new Fl_Light_Button(280, 355, 140, 20, "Progressive");
+	m_progressiveSwitch->user_data((void*)(this));
+	m_progressiveSwitch->value(m_isProgressive);
+	m_progressiveSwitch->callback(cb_progressiveSwitch);
+
+	m_wavefrontSwitch = new Fl_Light_Button(280, 330, 140, 20, "Wavefront");
+	m_wavefrontSwitch->user_data((void*)(this));
+	m_wavefrontSwitch->value(m_isWavefront);
+	m_wavefrontSwitch->callback(cb_wavefrontSwitch);
+
+	m_binningSwitch = new Fl_Light_Button(280, 305, 140, 20, "Ray Binning");
+	m_binningSwitch->user_data((void*)(this));
+	m_binningSwitch->value(m_isBinning);
+	m_binningSwitch->callback(cb_binningSwitch);
+
 	m_renderButton = new Fl_Button(340, 27, 70, 25, "&Render");
 	m_renderButton->user_data((void*)(this));
 	m_renderButton->callback(cb_render);
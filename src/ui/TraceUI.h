@@ -13,10 +13,13 @@
 #include <FL/Fl_Value_Slider.H>
 #include <FL/Fl_Check_Button.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Choice.H>
 
 #include <FL/fl_file_chooser.H>		// FLTK file chooser
 
 #include "TraceGLWindow.h"
+#include "../sampler.h"
+#include "../scene/settings.h"
 
 class TraceUI {
 public:
@@ -30,14 +33,21 @@ public:
 	Fl_Slider*			m_depthSlider;
 	Fl_Light_Button*	m_shadowSwitch;
 	Fl_Light_Button*	m_softShadowSwitch;
+	Fl_Slider*			m_softShadowSlider;
+	Fl_Choice*			m_samplerChoice;
 	Fl_Light_Button*	m_reflectionSwitch;
 	Fl_Slider*			m_glossySlider;
 	Fl_Light_Button*	m_fresnelSwitch;
 	Fl_Slider*			m_fresnelSlider;
 	Fl_Light_Button*	m_refractionSwitch;
+	Fl_Light_Button*	m_occluderCacheSwitch;
+	Fl_Light_Button*	m_progressiveSwitch;
+	Fl_Light_Button*	m_wavefrontSwitch;
+	Fl_Light_Button*	m_binningSwitch;
 	Fl_Slider*			m_threadSlider;
 	Fl_Slider*			m_intensityThresholdSlider;
 	Fl_Slider*			m_superSamplingSlider;
+	Fl_Slider*			m_adaptiveSlider;
 	Fl_Light_Button*	m_distanceSwitch;
 	Fl_Slider*			m_aConstantSlider;
 	Fl_Slider*			m_aLinearSlider;
@@ -83,6 +93,16 @@ public:
 		return m_glossySample;
 	}
 
+	int GetSoftShadowSample() const
+	{
+		return m_softShadowSample;
+	}
+
+	Sampler::Kind GetSampler() const
+	{
+		return m_sampler;
+	}
+
 	bool IsEnableFresnel() const
 	{
 		return m_isFresnel;
@@ -98,6 +118,29 @@ public:
 		return m_isRefraction;
 	}
 
+	bool IsEnableOccluderCache() const
+	{
+		return m_isOccluderCache;
+	}
+
+	// one sample per pixel per pass, shown as each pass finishes
+	bool IsEnableProgressive() const
+	{
+		return m_isProgressive;
+	}
+
+	// the breadth-first integrator rather than the recursive one
+	bool IsEnableWavefront() const
+	{
+		return m_isWavefront;
+	}
+
+	// sort each wave of the wavefront integrator before tracing it
+	bool IsEnableBinning() const
+	{
+		return m_isBinning;
+	}
+
 	int	GetThread() const
 	{
 		return m_thread;
@@ -113,6 +156,12 @@ public:
 		return m_superSampling;
 	}
 
+	// 0 to take every supersample everywhere
+	double GetAdaptiveThreshold() const
+	{
+		return m_adaptiveThreshold;
+	}
+
 	bool IsOverideDistance() const
 	{
 		return m_isOveride;
@@ -133,6 +182,9 @@ public:
 		return m_aQuadratic;
 	}
 
+	// the widgets' values, to be taken by a render as it starts
+	RenderSettings getSettings() const;
+
 private:
 	RayTracer*	raytracer;
 
@@ -142,12 +194,19 @@ private:
 	bool m_isSoftShadow;
 	bool m_isReflection;
 	int m_glossySample;
+	int m_softShadowSample;
+	Sampler::Kind m_sampler;
 	bool m_isFresnel;
 	double m_fresnelRatio;
 	bool m_isRefraction;
+	bool m_isOccluderCache;
+	bool m_isProgressive;
+	bool m_isWavefront;
+	bool m_isBinning;
 	int m_thread;
 	double m_intensity;
 	int m_superSampling;
+	double m_adaptiveThreshold;
 	bool m_isOveride;
 	double m_aConstant;
 	double m_aLinear;
@@ -162,6 +221,7 @@ private:
 
 	static void cb_load_scene(Fl_Menu_* o, void* v);
 	static void cb_save_image(Fl_Menu_* o, void* v);
+	static void cb_save_heatmap(Fl_Menu_* o, void* v);
 	static void cb_exit(Fl_Menu_* o, void* v);
 	static void cb_about(Fl_Menu_* o, void* v);
 
@@ -171,14 +231,21 @@ private:
 	static void cb_depthSlides(Fl_Widget* o, void* v);
 	static void cb_shadowSwitch(Fl_Widget* o, void* v);
 	static void cb_softShadowSwitch(Fl_Widget* o, void* v);
+	static void cb_softShadowSlides(Fl_Widget* o, void* v);
+	static void cb_samplerChoice(Fl_Widget* o, void* v);
 	static void cb_reflectionSwitch(Fl_Widget* o, void* v);
 	static void cb_glossyReflectionSlides(Fl_Widget* o, void* v);
 	static void cb_fresnelSwitch(Fl_Widget* o, void* v);
 	static void cb_fresnelSlides(Fl_Widget* o, void* v);
 	static void cb_refractionSwitch(Fl_Widget* o, void* v);
+	static void cb_occluderCacheSwitch(Fl_Widget* o, void* v);
+	static void cb_progressiveSwitch(Fl_Widget* o, void* v);
+	static void cb_wavefrontSwitch(Fl_Widget* o, void* v);
+	static void cb_binningSwitch(Fl_Widget* o, void* v);
 	static void cb_threadSlides(Fl_Widget* o, void* v);
 	static void cb_intensityThresholdSlides(Fl_Widget* o, void* v);
 	static void cb_superSamplingSlides(Fl_Widget* o, void* v);
+	static void cb_adaptiveSlides(Fl_Widget* o, void* v);
 	static void cb_distanceSwitch(Fl_Widget* o, void* v);
 	static void cb_aConstantSlides(Fl_Widget* o, void* v);
 	static void cb_aLinearSlides(Fl_Widget* o, void* v);
@@ -188,9 +255,6 @@ private:
 	static void cb_stop(Fl_Widget* o, void* v);
 
 	void load_scene(const char *file);
-
-	static void RenderWorker(TraceUI *ui, const int from_y, const int to_y,
-		const int w);
 };
 
 #endif
@@ -20,10 +20,10 @@ VecCone::VecCone(const vec3f &center, const double x)
 	m_transform = mat3f() + vx + vx * vx * ((1 - cos) / (sin * sin));
 }
 
-vec3f VecCone::Generate() const
+vec3f VecCone::Generate(const double s, const double t) const
 {
-	const double x = rand() / (double)RAND_MAX * m_x;
-	const double theta = rand() / (double)RAND_MAX * 2 * M_PI;
+	const double x = s * m_x;
+	const double theta = t * 2 * M_PI;
 	vec3f v;
 	v[2] = cos(x);
 	const double r = sqrt(1 - v[2] * v[2]);
@@ -8,7 +8,8 @@ class VecCone
 public:
 	VecCone(const vec3f &center, const double x);
 
-	vec3f Generate() const;
+	// the direction for the point (s, t) of the unit square
+	vec3f Generate(const double s, const double t) const;
 
 private:
 	vec3f m_center;
@@ -0,0 +1,123 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+// Thin wrappers over the SSE2 and AVX intrinsics used by the intersection
+// kernels, so that one kernel body serves both instruction sets.  vfloat
+// holds SIMD_FLOAT_LANES floats and vdouble SIMD_DOUBLE_LANES doubles;
+// where neither instruction set is available both lane counts are 1 and
+// the kernels use their scalar loops instead.
+//
+// Define RAY_NO_SIMD to force the scalar kernels.
+
+#if !defined(RAY_NO_SIMD) && defined(__AVX__)
+#define SIMD_FLOAT_LANES 8
+#define SIMD_DOUBLE_LANES 4
+#elif !defined(RAY_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) \
+	|| (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SIMD_FLOAT_LANES 4
+#define SIMD_DOUBLE_LANES 2
+#else
+#define SIMD_FLOAT_LANES 1
+#define SIMD_DOUBLE_LANES 1
+#endif
+
+#if SIMD_FLOAT_LANES > 1
+
+#include <immintrin.h>
+
+namespace simd
+{
+
+#if SIMD_FLOAT_LANES == 8
+
+	typedef __m256 vfloat;
+	typedef __m256d vdouble;
+
+	inline vfloat vset(float f) { return _mm256_set1_ps(f); }
+	inline vfloat vload(const float *p) { return _mm256_loadu_ps(p); }
+	inline void vstore(float *p, vfloat a) { _mm256_storeu_ps(p, a); }
+	inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+	inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+	inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+	inline vfloat vand(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+	inline vfloat vor(vfloat a, vfloat b) { return _mm256_or_ps(a, b); }
+	inline vfloat vandnot(vfloat a, vfloat b) { return _mm256_andnot_ps(a, b); }
+	inline vfloat vge(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	inline vfloat vgt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	inline vfloat vlt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	inline vfloat vle(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	inline vfloat veq(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	inline int vmask(vfloat a) { return _mm256_movemask_ps(a); }
+
+	inline vdouble vset(double d) { return _mm256_set1_pd(d); }
+	inline vdouble vload(const double *p) { return _mm256_loadu_pd(p); }
+	inline void vstore(double *p, vdouble a) { _mm256_storeu_pd(p, a); }
+	inline vdouble vadd(vdouble a, vdouble b) { return _mm256_add_pd(a, b); }
+	inline vdouble vsub(vdouble a, vdouble b) { return _mm256_sub_pd(a, b); }
+	inline vdouble vmul(vdouble a, vdouble b) { return _mm256_mul_pd(a, b); }
+	inline vdouble vdiv(vdouble a, vdouble b) { return _mm256_div_pd(a, b); }
+	inline vdouble vsqrt(vdouble a) { return _mm256_sqrt_pd(a); }
+	inline vdouble vmin(vdouble a, vdouble b) { return _mm256_min_pd(a, b); }
+	inline vdouble vmax(vdouble a, vdouble b) { return _mm256_max_pd(a, b); }
+	inline vdouble vand(vdouble a, vdouble b) { return _mm256_and_pd(a, b); }
+	inline vdouble vor(vdouble a, vdouble b) { return _mm256_or_pd(a, b); }
+	inline vdouble vandnot(vdouble a, vdouble b) { return _mm256_andnot_pd(a, b); }
+	inline vdouble vgt(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+	inline vdouble vge(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+	inline vdouble vlt(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+	inline vdouble vle(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+	inline vdouble veq(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+	inline int vmask(vdouble a) { return _mm256_movemask_pd(a); }
+
+#else
+
+	typedef __m128 vfloat;
+	typedef __m128d vdouble;
+
+	inline vfloat vset(float f) { return _mm_set1_ps(f); }
+	inline vfloat vload(const float *p) { return _mm_loadu_ps(p); }
+	inline void vstore(float *p, vfloat a) { _mm_storeu_ps(p, a); }
+	inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+	inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+	inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+	inline vfloat vand(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+	inline vfloat vor(vfloat a, vfloat b) { return _mm_or_ps(a, b); }
+	inline vfloat vandnot(vfloat a, vfloat b) { return _mm_andnot_ps(a, b); }
+	inline vfloat vge(vfloat a, vfloat b) { return _mm_cmpge_ps(a, b); }
+	inline vfloat vgt(vfloat a, vfloat b) { return _mm_cmpgt_ps(a, b); }
+	inline vfloat vlt(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+	inline vfloat vle(vfloat a, vfloat b) { return _mm_cmple_ps(a, b); }
+	inline vfloat veq(vfloat a, vfloat b) { return _mm_cmpeq_ps(a, b); }
+	inline int vmask(vfloat a) { return _mm_movemask_ps(a); }
+
+	inline vdouble vset(double d) { return _mm_set1_pd(d); }
+	inline vdouble vload(const double *p) { return _mm_loadu_pd(p); }
+	inline void vstore(double *p, vdouble a) { _mm_storeu_pd(p, a); }
+	inline vdouble vadd(vdouble a, vdouble b) { return _mm_add_pd(a, b); }
+	inline vdouble vsub(vdouble a, vdouble b) { return _mm_sub_pd(a, b); }
+	inline vdouble vmul(vdouble a, vdouble b) { return _mm_mul_pd(a, b); }
+	inline vdouble vdiv(vdouble a, vdouble b) { return _mm_div_pd(a, b); }
+	inline vdouble vsqrt(vdouble a) { return _mm_sqrt_pd(a); }
+	inline vdouble vmin(vdouble a, vdouble b) { return _mm_min_pd(a, b); }
+	inline vdouble vmax(vdouble a, vdouble b) { return _mm_max_pd(a, b); }
+	inline vdouble vand(vdouble a, vdouble b) { return _mm_and_pd(a, b); }
+	inline vdouble vor(vdouble a, vdouble b) { return _mm_or_pd(a, b); }
+	inline vdouble vandnot(vdouble a, vdouble b) { return _mm_andnot_pd(a, b); }
+	inline vdouble vgt(vdouble a, vdouble b) { return _mm_cmpgt_pd(a, b); }
+	inline vdouble vge(vdouble a, vdouble b) { return _mm_cmpge_pd(a, b); }
+	inline vdouble vlt(vdouble a, vdouble b) { return _mm_cmplt_pd(a, b); }
+	inline vdouble vle(vdouble a, vdouble b) { return _mm_cmple_pd(a, b); }
+	inline vdouble veq(vdouble a, vdouble b) { return _mm_cmpeq_pd(a, b); }
+	inline int vmask(vdouble a) { return _mm_movemask_pd(a); }
+
+#endif
+
+	// mask ? a : b, per lane
+	inline vfloat vselect(vfloat mask, vfloat a, vfloat b) { return vor(vand(mask, a), vandnot(mask, b)); }
+	inline vdouble vselect(vdouble mask, vdouble a, vdouble b) { return vor(vand(mask, a), vandnot(mask, b)); }
+
+}
+
+#endif // SIMD_FLOAT_LANES > 1
+
+#endif // __SIMD_H__